@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2026 Văn Tiến <tien11102004@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef MODBUS_BUS_H
+#define MODBUS_BUS_H
+
+#include <linux/hrtimer.h>
+#include <linux/timer.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include "modbus_controller.h"
+#include "modbus_rtu/Include/mbport.h"
+#include "modbus_rtu/Include/mbrtu.h"
+
+/* Only the master side of lightmodbus is used */
+#ifndef LIGHTMODBUS_MASTER
+#define LIGHTMODBUS_MASTER
+#endif
+#include "modbus_rtu/lightmodbus/lightmodbus.h"
+
+/* -------------------------------------------------------------------------
+ * Structure definitions
+ * ------------------------------------------------------------------------- */
+
+/**
+ * struct modbus_slave - What the bus learned about one slave address
+ * @srtt_us:	Smoothed round trip time, 0 while there is no sample
+ * @rttvar_us:	Round trip time variation
+ * @breaker:	Circuit breaker state
+ * @failures:	Consecutive timeouts
+ * @backoff:	Current open period of the breaker in ms
+ * @retry_at:	End of the open period, the next transaction is a probe
+ *
+ * The round trip time runs from request start to reply received, so it
+ * covers both frames on the line.
+ */
+struct modbus_slave {
+	uint32_t				srtt_us;
+	uint32_t				rttvar_us;
+	enum modbus_breaker		breaker;
+	uint32_t				failures;
+	uint32_t				backoff;
+	ktime_t					retry_at;
+};
+
+/**
+ * struct modbus_bus - One Modbus RTU bus, allocated per probed controller UART
+ *
+ * Serdev (modbuscontroller.c)
+ * @serdev:			UART of the bus
+ * @baudrate:		Line speed, from 'lsmy,baudrate' or 9600
+ * @early_frame_end:	Deliver a reply once its expected length is received, from 'lsmy,early-frame-end'
+ * @transmit_success:	Transmit FSM callback
+ * @receive_callback:	Receive FSM callback, gets the serdev bytes in place
+ *
+ * T3.5 timer (modbuscontroller_timer.c)
+ * @t35_timer:		Silence timer
+ * @t35_interval:	T3.5 of @baudrate
+ * @t35_expired:	Timer expiry callback
+ *
+ * Link layer and event port (modbus_rtu/)
+ * @rtu:			RTU FSM state and receive frame pool
+ * @event:			Event ring and tasklet
+ *
+ * Master (modbus_rtu/modbus.c)
+ * @master:			lightmodbus master instance
+ * @build_lock:		Serializes the request builder of @master
+ * @build_xfer:		Transaction whose PDU @master is building, under @build_lock
+ * @xfer_queue:		Transactions waiting for the bus, in submission order
+ * @xfer_lock:		Protects @xfer_queue and @xfer_accept
+ * @xfer_accept:	Submissions are refused while the bus is stopped
+ * @xfer_active:	Transaction currently on the bus (tasklet only)
+ * @rsp_deadline:	Monotonic time at which @xfer_active times out (tasklet only)
+ * @rsp_timer:		Response timeout of @xfer_active, armed on @rsp_deadline
+ * @rsp_sent:		Start time of @xfer_active, for the round trip time
+ * @slave:			Round trip time and health of every slave address (written by the tasklet only)
+ * @master_state:	Master state machine (tasklet only)
+ *
+ * Poller (modbuscontroller_poller.c)
+ * @poll_clients:	Devices sampled by the poller, protected by @poll_lock
+ * @poll_lock:		Protects the client list and deadlines, not held during a poll
+ * @poll_wq:		Wakes the poller when the client list or a deadline changes,
+ *					and modbus_poller_remove() when a poll is over
+ * @poll_changed:	Set with @poll_wq
+ * @poll_running:	Client being polled, set and cleared under @poll_lock
+ * @poll_task:		Poller thread of the bus
+ * * Every layer keeps its state here instead of in file scope variables,
+ * so each UART runs its own independent stack.
+ */
+struct modbus_bus {
+	struct serdev_device	*serdev;
+	uint32_t				baudrate;
+	bool					early_frame_end;
+	bool					(*transmit_success)(struct modbus_bus *bus);
+	bool					(*receive_callback)(struct modbus_bus *bus, const unsigned char *data,
+												uint16_t count);
+
+	struct hrtimer			t35_timer;
+	ktime_t					t35_interval;
+	bool					(*t35_expired)(struct modbus_bus *bus);
+
+	xMBRTUState				rtu;
+	xMBPortEventState		event;
+
+	ModbusMaster			master;
+	struct mutex			build_lock;
+	struct modbus_xfer		*build_xfer;
+	struct list_head		xfer_queue;
+	spinlock_t				xfer_lock;
+	bool					xfer_accept;
+	struct modbus_xfer		*xfer_active;
+	ktime_t					rsp_deadline;
+	struct hrtimer			rsp_timer;
+	ktime_t					rsp_sent;
+	struct modbus_slave		slave[U8_MAX + 1];
+	eMasterType				master_state;
+
+	struct list_head		poll_clients;
+	struct mutex			poll_lock;
+	wait_queue_head_t		poll_wq;
+	bool					poll_changed;
+	struct modbus_poll_client	*poll_running;
+	struct task_struct		*poll_task;
+};
+
+/* -------------------------------------------------------------------------
+ * Function Prototypes 
+ * ------------------------------------------------------------------------- */
+
+/*
+ * for Modbus controller (Serdev device) 
+ * */
+void modbus_controller_write(struct modbus_bus *bus, char *buffer, int length);
+void register_modbus_callbacks(struct modbus_bus *bus, bool (*tx_func)(struct modbus_bus *bus),
+							   bool (*rx_func)(struct modbus_bus *bus, const unsigned char *data, uint16_t count));
+
+/*
+ *	For Modbus timer 
+ */
+void timer_init(struct modbus_bus *bus, int usTimTimerout50us); 
+void timer_start(struct modbus_bus *bus);
+void timer_cancel(struct modbus_bus *bus);
+void timer_remove(struct modbus_bus *bus);
+void timer_register_callback(struct modbus_bus *bus, bool (*hrtimer_expired_callback)(struct modbus_bus *bus));
+
+/*
+ *	For Modbus poller
+ */
+int modbus_poller_start(struct modbus_bus *bus);
+void modbus_poller_stop(struct modbus_bus *bus);
+
+/* 
+ * For Modbus application 
+ */ 
+bool ModbusInit(struct modbus_bus *bus, int baud);
+bool ModbusStart(struct modbus_bus *bus);
+void ModbusRun(struct modbus_bus *bus);
+void ModbusDestroy(struct modbus_bus *bus);
+
+#endif /* MODBUS_BUS_H */
@@ -1,13 +1,38 @@
+#ifndef MODBUS_CONTROLLER_H
+#define MODBUS_CONTROLLER_H
+
 #include <linux/serdev.h>			/* For register to serdev (modbus_controller)*/
 #include <linux/mod_devicetable.h>
 #include <linux/of.h>               /* For Device Tree (DT) matching functions */
 #include <linux/of_device.h>        /* For extracting match data from DT */
 #include <linux/platform_device.h>  /* For platform driver/device structures */
 #include <linux/of_platform.h>
+#include <linux/list.h>				/* For the poll client list */
+#include <linux/ktime.h>			/* For poll deadlines */
+#include <linux/completion.h>		/* For synchronous transactions */
 /* -------------------------------------------------------------------------
- * Global variable 
+ * Limits
  * ------------------------------------------------------------------------- */
-extern struct serdev_device *modbus_controller;
+#define MODBUS_MAX_READ_REGS	125	/* Maximum number of registers returned by one read request */
+#define MODBUS_MAX_PDU			253	/* Maximum size of a Modbus PDU */
+#define MODBUS_MAX_ADU			256	/* Maximum size of a Modbus RTU frame: address, PDU and CRC */
+#define MODBUS_MAX_WRITE_COILS	1968	/* Maximum number of coils written by FC15 */
+#define MODBUS_MAX_WRITE_REGS	123	/* Maximum number of registers written by FC16 */
+#define MODBUS_MAX_RW_WRITE_REGS	121	/* Maximum number of registers written by FC23 */
+
+/* -------------------------------------------------------------------------
+ * Debug logging
+ * ------------------------------------------------------------------------- */
+/*
+ * Per-frame and per-byte messages of the hot path. With MODBUS_DEBUG_LOG they
+ * are pr_debug() messages, enabled through dynamic debug. Without it they are
+ * compiled out, the format is still checked.
+ */
+#ifdef CONFIG_MODBUS_DEBUG_LOG
+#define mb_dbg(fmt, ...)	pr_debug(fmt, ##__VA_ARGS__)
+#else
+#define mb_dbg(fmt, ...)	no_printk(fmt, ##__VA_ARGS__)
+#endif
 
 /* -------------------------------------------------------------------------
  * Enum definitions
@@ -22,36 +47,167 @@ typedef enum
 	ESEND_TIMEOUT,				/*!< Send Timeout. */
 	ESEND_RQINVAL,				/*!< Request Invalid. */
 	ESEND_RPINVAL,				/*!< Respone Invalid. */
+	ESEND_CANCELED,				/*!< Bus stopped before the request was sent. */
+	ESEND_HOSTDOWN,				/*!< Slave breaker open, the request was not sent. */
 } SendRetType;
 
+/**
+ * enum modbus_breaker - Circuit breaker state of a slave
+ * @MODBUS_BREAKER_CLOSED:		Healthy, transactions go on the bus
+ * @MODBUS_BREAKER_OPEN:		Slave does not answer, transactions fail at once
+ * @MODBUS_BREAKER_HALF_OPEN:	Backoff elapsed, the next transaction probes the slave
+ */
+enum modbus_breaker {
+	MODBUS_BREAKER_CLOSED,
+	MODBUS_BREAKER_OPEN,
+	MODBUS_BREAKER_HALF_OPEN,
+};
+
+/* -------------------------------------------------------------------------
+ * Structure definitions
+ * ------------------------------------------------------------------------- */
+
+/* One Modbus RTU bus (controller UART), private to the controller module */
+struct modbus_bus;
+
+/**
+ * struct modbus_poll_client - A device sampled in background by the bus poller
+ * @node:		Entry in the poller client list
+ * @deadline:	Next time the client is due, managed by the poller
+ * @poll:		Runs the bus transactions of one sample, called from the poller
+ *				thread. Returns the delay in ms until the next sample.
+ */
+struct modbus_poll_client {
+	struct list_head	node;
+	ktime_t				deadline;
+	uint32_t			(*poll)(struct modbus_poll_client *client);
+};
+
+/**
+ * struct modbus_xfer - One Modbus transaction, queued on the bus by modbus_submit()
+ * @node:		Entry in the bus FIFO
+ * @address:	Slave address
+ * @function:	Function code (1 - 6, 15, 16, 23)
+ * @start:		Address of the first register / coil, read or written
+ * @quantity:	Number of registers / coils to read or write, or the value to write for FC05/FC06
+ * @write_start:	FC23 only, address of the first register to write
+ * @write_quantity:	FC23 only, number of registers to write
+ * @write_values:	Values to write, @quantity entries for FC15/FC16 (one per coil for FC15,
+ *				non-zero is ON), @write_quantity entries for FC23. Copied into @pdu by
+ *				modbus_submit(), the buffer may be reused once it returns.
+ * @timeout:	Upper bound of the response timeout in ms, the bus adapts it to the slave
+ * @values:		Destination of the values read, room for @quantity entries (FC01 - FC04, FC23)
+ * @count:		Number of values stored into @values
+ * @status:		Result of the transaction, valid once completed
+ * @exception:	Exception code returned by the slave, 0 if none
+ * @complete:	Optional completion callback, called from the bus tasklet (atomic context).
+ *				If NULL, @done is completed instead.
+ * @context:	Caller private pointer, for @complete
+ * @done:		Completed when @complete is NULL, see modbus_xfer_wait()
+ * @adu:		Request frame (address, PDU, CRC), built in place by modbus_submit(), no
+ *				heap allocation. A read submitted again with the same address, function,
+ *				start and quantity reuses it as is, nothing is rebuilt.
+ * @adu_len:	Length of @adu, 0 until built. Must be 0 in a new transaction.
+ * @pdu_len:	Length of the PDU inside @adu
+ * @followers:	Identical reads sharing the result of this one, see modbus_submit()
+ * * The caller owns the structure, it must stay valid until the transaction
+ * is completed.
+ */
+struct modbus_xfer {
+	struct list_head	node;
+	uint8_t				address;
+	uint8_t				function;
+	uint16_t			start;
+	uint16_t			quantity;
+	uint16_t			write_start;
+	uint16_t			write_quantity;
+	const uint16_t		*write_values;
+	uint32_t			timeout;
+	uint16_t			*values;
+	uint16_t			count;
+	SendRetType			status;
+	uint8_t				exception;
+	void				(*complete)(struct modbus_xfer *xfer);
+	void				*context;
+	struct completion	done;
+	uint8_t				adu[MODBUS_MAX_ADU];
+	uint16_t			adu_len;
+	uint8_t				pdu_len;
+	struct list_head	followers;
+};
+
+/**
+ * struct modbus_rtt_estimate - Live response time estimate of one slave
+ * @srtt_us:	Smoothed round trip time, 0 until the slave has answered once
+ * @rttvar_us:	Round trip time variation
+ * @timeout_us:	Response timeout the next transaction to the slave gets
+ */
+struct modbus_rtt_estimate {
+	uint32_t	srtt_us;
+	uint32_t	rttvar_us;
+	uint32_t	timeout_us;
+};
+
+/**
+ * struct modbus_slave_health - Live health of one slave
+ * @breaker:	Circuit breaker state
+ * @failures:	Consecutive timeouts
+ * @backoff:	Open period of the breaker in ms, 0 while closed
+ */
+struct modbus_slave_health {
+	enum modbus_breaker	breaker;
+	uint32_t			failures;
+	uint32_t			backoff;
+};
+
+/* -------------------------------------------------------------------------
+ * Helper functions
+ * ------------------------------------------------------------------------- */
+/**
+ * modbus_send_errno - Converts a transaction result into a negative errno
+ */
+static inline int modbus_send_errno(SendRetType ret)
+{
+	switch (ret)
+	{
+		case ESEND_NOERR:		return 0;
+		case ESEND_TIMEOUT:		return -ETIMEDOUT;
+		case ESEND_RQINVAL:		return -EINVAL;
+		case ESEND_RPINVAL:		return -EPROTO;
+		case ESEND_CANCELED:	return -ECANCELED;
+		case ESEND_HOSTDOWN:	return -EHOSTDOWN;
+	}
+	return -EIO;
+}
+
 /* -------------------------------------------------------------------------
  * Function Prototypes 
  * ------------------------------------------------------------------------- */
 
 /*
- * for Modbus controller (Serdev device) 
- * */
-void modbus_controller_write(char *buffer, int length);
-void modbus_controller_read(char *buffer, int *count);
-void register_modbus_callbacks(bool (*tx_func)(void), bool (*rx_func)(void));
+ * For Modbus bus (one per controller UART)
+ * Child devices find the bus of their parent controller node.
+ */
+struct modbus_bus *modbus_bus_from_device(struct device *parent);
 
 /*
- *	For Modbus timer 
+ *	For Modbus poller
  */
-void timer_init(int usTimTimerout50us); 
-void timer_start(void);
-void timer_cancel(void);
-void timer_remove(void);
-void timer_register_callback(bool (*hrtimer_expired_callback)(void));
+void modbus_poller_add(struct modbus_bus *bus, struct modbus_poll_client *client);
+void modbus_poller_remove(struct modbus_bus *bus, struct modbus_poll_client *client);
+void modbus_poller_kick(struct modbus_bus *bus, struct modbus_poll_client *client);
 
 /* 
  * For Modbus application 
  * Bridge between app and link layer
  */ 
+SendRetType ModbusSend(struct modbus_bus *bus, char Address, int function, int startAddress, int quantity,
+					   uint16_t *values, int timeout);
+int modbus_submit(struct modbus_bus *bus, struct modbus_xfer *xfer);
+int modbus_submit_batch(struct modbus_bus *bus, struct modbus_xfer *xfers, unsigned int count);
+SendRetType modbus_xfer_wait(struct modbus_xfer *xfer);
+void modbus_rtt_get(struct modbus_bus *bus, uint8_t address, uint32_t timeout,
+					struct modbus_rtt_estimate *est);
+void modbus_health_get(struct modbus_bus *bus, uint8_t address, struct modbus_slave_health *health);
 
-bool ModbusInit(int baud);
-bool ModbusStart(void);
-void ModbusRun(void);
-void ModbusDestroy(void);
-SendRetType ModbusSend(char Address, int function, int startAddress, int quantity, int timeout);
-void ModbusReceive(unsigned char *buffer, uint16_t *length);
+#endif /* MODBUS_CONTROLLER_H */
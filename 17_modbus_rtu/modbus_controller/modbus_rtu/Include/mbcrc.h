@@ -30,6 +30,12 @@
 #ifndef _MB_CRC_H
 #define _MB_CRC_H
 
+#define MB_CRC16_INIT   0xFFFF  /*!< CRC register value before the first byte. */
+
+void            vMBCRC16Init( void );
+
+USHORT          usMBCRC16Update( USHORT usCRC, const UCHAR * pucFrame, USHORT usLen );
+
 USHORT          usMBCRC16( const UCHAR * pucFrame, USHORT usLen );
 
 #endif
@@ -34,6 +34,8 @@
 #ifndef _MB_PORT_H
 #define _MB_PORT_H
 
+#include <linux/kfifo.h>
+#include <linux/interrupt.h>
 #include "port.h"
 
 #ifdef __cplusplus
@@ -75,25 +77,44 @@ typedef enum
     MB_PAR_EVEN                 /*!< Even parity. */
 } eMBParity;
 
-/* ----------------------- Supporting functions -----------------------------*/
-BOOL            xMBPortEventInit( void );
+#define MB_EVENT_RING_SIZE	16	/* Power of 2, far more than the events of one transaction */
+
+/* One queued event, stamped when it is posted */
+typedef struct
+{
+    eMBEventType    eType;
+    ktime_t         xTime;
+} xMBPortEvent;
+
+/* Event port state, one per bus.
+ * Events are posted from the hrtimer, the serdev callbacks and the tasklet,
+ * the producers are serialized by xLock. The tasklet is the only
+ * consumer and reads the ring without lock.
+ */
+typedef struct
+{
+    DECLARE_KFIFO(xRing, xMBPortEvent, MB_EVENT_RING_SIZE);
+    spinlock_t              xLock;
+    struct tasklet_struct   xTasklet;
+} xMBPortEventState;
 
-BOOL            xMBPortEventPost( eMBEventType eEvent );
+/* ----------------------- Supporting functions -----------------------------*/
+BOOL            xMBPortEventInit( struct modbus_bus * bus );
 
-BOOL            xMBPortEventGet(  /*@out@ */ eMBEventType * eEvent );
+BOOL            xMBPortEventPost( struct modbus_bus * bus, eMBEventType eEvent );
 
-void			vMBPortEventDeinit(void);
+BOOL            xMBPortEventGet( struct modbus_bus * bus, /*@out@ */ eMBEventType * eEvent, /*@out@ */ ktime_t * pxTime );
 
-/* ----------------------- Timers functions ---------------------------------*/
-BOOL            xMBPortTimersInit( USHORT usTimeOut50us );
+void			vMBPortEventKick( struct modbus_bus * bus );
 
-void            xMBPortTimersClose( void );
+void			vMBPortEventDeinit( struct modbus_bus * bus );
 
-void            vMBPortTimersStart( void );
+/* ----------------------- Timers functions ---------------------------------*/
+BOOL            xMBPortTimersInit( struct modbus_bus * bus, USHORT usTimeOut50us );
 
-void            vMBPortTimersCancel( void );
+void            vMBPortTimersStart( struct modbus_bus * bus );
 
-void            vMBPortTimersDelay( USHORT usTimeOutMS );
+void            vMBPortTimersCancel( struct modbus_bus * bus );
 
 /* ----------------------- Callback for the protocol stack ------------------*/
 
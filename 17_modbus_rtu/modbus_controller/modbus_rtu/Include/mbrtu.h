@@ -35,16 +35,71 @@ PR_BEGIN_EXTERN_C
 #endif
 #include "mb.h"
 
-eMBErrorCode eMBRTUInit(ULONG ulBaudRate);
-void            eMBRTUStart( void );
-void            eMBRTUStop( void );
-eMBErrorCode    eMBRTUReceive( UCHAR * pucRcvAddress, UCHAR * pucFrame, USHORT * pusLength );
-eMBErrorCode 	eMBRTUSend( UCHAR ucSlaveAddress, const UCHAR * pucFrame, USHORT usLength );
-BOOL            xMBRTUReceiveFSM( void );
-BOOL			xMBRTUReceiveTrigger ( void );
-BOOL            xMBRTUTransmitSuccess( void );
-BOOL            xMBRTUTimerT15Expired( void );
-BOOL            xMBRTUTimerT35Expired( void );
+/* ----------------------- Defines ------------------------------------------*/
+#define MB_SER_PDU_SIZE_MAX     256     /*!< Maximum size of a Modbus RTU frame. */
+#define MB_RTU_RX_FRAMES        4       /*!< Receive frame pool, power of 2. */
+
+/* ----------------------- Type definitions ---------------------------------*/
+typedef enum
+{
+    STATE_RX_INIT,              /*!< Receiver is in initial state. */
+    STATE_RX_IDLE,              /*!< Receiver is in idle state. */
+    STATE_RX_RCV,               /*!< Frame is beeing received. */
+    STATE_RX_ERROR              /*!< If the frame is invalid. */
+} eMBRcvState;
+
+typedef enum
+{
+    STATE_TX_IDLE,              /*!< Transmitter is in idle state. */
+    STATE_TX_XMIT               /*!< Transmitter is in transfer state. */
+} eMBSndState;
+
+/* One received RTU frame, filled in place from the serdev receive callback */
+typedef struct
+{
+    UCHAR           ucBuf[MB_SER_PDU_SIZE_MAX];
+    USHORT          usLength;       /*!< Address, PDU and CRC. */
+    USHORT          usCRC;          /*!< CRC over the whole frame, 0 if valid. */
+} xMBRTUFrame;
+
+/* RTU link layer state, one per bus */
+typedef struct
+{
+    volatile eMBSndState eSndState;
+    volatile eMBRcvState eRcvState;
+
+    /* Frames [ulRcvTail, ulRcvHead) wait for the master, slot ulRcvHead is
+     * the one being received. Single producer (receive FSM / T3.5 timer),
+     * single consumer (master tasklet).
+     */
+    xMBRTUFrame     xRcvFrames[MB_RTU_RX_FRAMES];
+    ULONG           ulRcvHead;
+    ULONG           ulRcvTail;
+
+    volatile USHORT usRcvBufferPos;
+    volatile USHORT usRcvCRC;       /*!< Running CRC of the bytes received so far. */
+    volatile USHORT usRcvExpected;  /*!< Length of the awaited reply, 0 if unknown. */
+    volatile BOOL   xRcvGap;        /*!< T3.5 silence after the last byte not over yet. */
+
+    /* Last frame handed to serdev, for the modbus_tx_done tracepoint */
+    UCHAR           ucSndAddress;
+    UCHAR           ucSndFunction;
+    USHORT          usSndLength;
+} xMBRTUState;
+
+/* ----------------------- Function prototypes ------------------------------*/
+eMBErrorCode    eMBRTUInit( struct modbus_bus * bus, ULONG ulBaudRate );
+void            eMBRTUStart( struct modbus_bus * bus );
+void            eMBRTUStop( struct modbus_bus * bus );
+BOOL            xMBRTUFramePending( struct modbus_bus * bus );
+eMBErrorCode    eMBRTUReceive( struct modbus_bus * bus, UCHAR * pucRcvAddress, const UCHAR ** pucFrame, USHORT * pusLength );
+void            vMBRTUReleaseFrame( struct modbus_bus * bus );
+eMBErrorCode 	eMBRTUSend( struct modbus_bus * bus, const UCHAR * pucFrame, USHORT usLength );
+BOOL            xMBRTUReceiveFSM( struct modbus_bus * bus, const UCHAR * pucData, USHORT usCount );
+void            vMBRTUExpectFrame( struct modbus_bus * bus, USHORT usLength );
+BOOL            xMBRTUBusSilent( struct modbus_bus * bus );
+BOOL            xMBRTUTransmitSuccess( struct modbus_bus * bus );
+BOOL            xMBRTUTimerT35Expired( struct modbus_bus * bus );
 
 #ifdef __cplusplus
 PR_END_EXTERN_C
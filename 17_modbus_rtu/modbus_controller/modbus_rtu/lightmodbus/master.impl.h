@@ -74,6 +74,10 @@ ModbusMasterFunctionHandler modbusMasterDefaultFunctions[] =
 	{22, modbusParseResponse22},
 #endif
 
+#if defined(LIGHTMODBUS_F23M) || defined(LIGHTMODBUS_MASTER_FULL)
+	{23, modbusParseResponse23},
+#endif
+
 	// Guard - prevents 0 size array
 	{0, NULL}
 };
@@ -85,6 +85,15 @@ LIGHTMODBUS_RET_ERROR modbusParseResponse22(
 	const uint8_t *responsePDU,
 	uint8_t responseLength);
 
+LIGHTMODBUS_RET_ERROR modbusParseResponse23(
+	ModbusMaster *status,
+	uint8_t address,
+	uint8_t function,
+	const uint8_t *requestPDU,
+	uint8_t requestLength,
+	const uint8_t *responsePDU,
+	uint8_t responseLength);
+
 LIGHTMODBUS_RET_ERROR modbusBuildRequest01020304(
 	ModbusMaster *status,
 	uint8_t function,
@@ -115,6 +124,14 @@ LIGHTMODBUS_RET_ERROR modbusBuildRequest22(
 	uint16_t andmask,
 	uint16_t ormask);
 
+LIGHTMODBUS_RET_ERROR modbusBuildRequest23(
+	ModbusMaster *status,
+	uint16_t readIndex,
+	uint16_t readCount,
+	uint16_t writeIndex,
+	uint16_t writeCount,
+	const uint16_t *values);
+
 /**
 	\brief Read multiple coils - a wrapper for modbusBuildRequest01020304()
 	\copydetails modbusBuildRequest01020304()
@@ -232,4 +249,9 @@ LIGHTMODBUS_DEFINE_BUILD_PDU_BODY(16, index, count, values)
 LIGHTMODBUS_DEFINE_BUILD_PDU_HEADER(22, uint16_t index, uint16_t andmask, uint16_t ormask)
 LIGHTMODBUS_DEFINE_BUILD_PDU_BODY(22, index, andmask, ormask)
 
+//! \copydoc modbusBuildRequest23
+//! \returns Any errors from modbusBeginRequestPDU() or modbusEndRequestPDU()
+LIGHTMODBUS_DEFINE_BUILD_PDU_HEADER(23, uint16_t readIndex, uint16_t readCount, uint16_t writeIndex, uint16_t writeCount, const uint16_t *values)
+LIGHTMODBUS_DEFINE_BUILD_PDU_BODY(23, readIndex, readCount, writeIndex, writeCount, values)
+
 #endif
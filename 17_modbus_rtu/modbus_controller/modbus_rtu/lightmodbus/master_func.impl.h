@@ -246,6 +246,76 @@ LIGHTMODBUS_RET_ERROR modbusParseResponse22(
 	return MODBUS_NO_ERROR();
 }
 
+/**
+	\brief Parses response to request 23 (read/write multiple registers)
+	\param address Address of the slave
+	\param function Response function code
+	\param requestPDU pointer to the PDU section of the request frame
+	\param requestLength request PDU section length
+	\param responsePDU pointer to the PDU section of the response frame
+	\param responseLength response PDU section length
+	\return MODBUS_REQUEST_ERROR(LENGTH) if request frame has invalid length
+	\return MODBUS_REQUEST_ERROR(COUNT) if the declared register count is invalid
+	\return MODBUS_REQUEST_ERROR(RANGE) if the declared register range wraps around address space
+	\return MODBUS_RESPONSE_ERROR(LENGTH) if the response length is not as expected
+	\return MODBUS_NO_ERROR() on success
+*/
+LIGHTMODBUS_RET_ERROR modbusParseResponse23(
+	ModbusMaster *status,
+	uint8_t address,
+	uint8_t function,
+	const uint8_t *requestPDU,
+	uint8_t requestLength,
+	const uint8_t *responsePDU,
+	uint8_t responseLength)
+{
+	// Check if lengths are ok
+	if (requestLength < 12) return MODBUS_REQUEST_ERROR(LENGTH);
+	if (responseLength < 2) return MODBUS_RESPONSE_ERROR(LENGTH);
+
+	uint16_t index = modbusRBE(&requestPDU[1]);
+	uint16_t count = modbusRBE(&requestPDU[3]);
+	uint16_t writeCount = modbusRBE(&requestPDU[7]);
+
+	// Check counts
+	if (count == 0 || count > 125)
+		return MODBUS_REQUEST_ERROR(COUNT);
+	if (writeCount == 0 || writeCount > 121)
+		return MODBUS_REQUEST_ERROR(COUNT);
+
+	// Verify if the request length is correct
+	if (requestPDU[9] != (writeCount << 1) || requestLength != (writeCount << 1) + 10)
+		return MODBUS_REQUEST_ERROR(LENGTH);
+
+	// Address range check
+	if (modbusCheckRangeU16(index, count))
+		return MODBUS_REQUEST_ERROR(RANGE);
+
+	// Check if declared data size matches
+	// and if response length is valid
+	if (responsePDU[1] != (count << 1) || responseLength != (count << 1) + 2)
+		return MODBUS_RESPONSE_ERROR(LENGTH);
+
+	// Prepare callback args
+	ModbusDataCallbackArgs cargs = {
+		.type = MODBUS_HOLDING_REGISTER,
+		.index = 0,
+		.value = 0,
+		.function = function,
+		.address = address,
+	};
+
+	// And finally read the data from the response
+	for (uint16_t i = 0; i < count; i++)
+	{
+		cargs.index = index + i;
+		cargs.value = modbusRBE(&responsePDU[2 + (i << 1)]);
+		status->dataCallback(status, &cargs);
+	}
+
+	return MODBUS_NO_ERROR();
+}
+
 /**
 	\brief Read mutiple coils/discrete inputs/holding registers/input registers
 	\param function 1 to read coils, 2 to read discrete inputs, 3 to read holding registers, 4 to read input registers
@@ -452,4 +522,52 @@ LIGHTMODBUS_RET_ERROR modbusBuildRequest22(
 	return MODBUS_NO_ERROR();
 }
 
+/**
+	\brief Read/write multiple holding registers, the write is performed before the read
+	\param readIndex Index of the first register to be read
+	\param readCount Number of registers to be read
+	\param writeIndex Index of the first register to be written
+	\param writeCount Number of registers to be written
+	\param values Pointer to array containing `writeCount` register values
+	\returns MODBUS_GENERAL_ERROR(COUNT) if `readCount` or `writeCount` is zero or too large
+	\returns MODBUS_GENERAL_ERROR(RANGE) if a register range wraps around the register space
+	\returns MODBUS_GENERAL_ERROR(ALLOC) on memory allocation error
+	\returns MODBUS_NO_ERROR() on success
+*/
+LIGHTMODBUS_RET_ERROR modbusBuildRequest23(
+	ModbusMaster *status,
+	uint16_t readIndex,
+	uint16_t readCount,
+	uint16_t writeIndex,
+	uint16_t writeCount,
+	const uint16_t *values)
+{
+	// Check counts
+	if (readCount == 0 || readCount > 125)
+		return MODBUS_GENERAL_ERROR(COUNT);
+	if (writeCount == 0 || writeCount > 121)
+		return MODBUS_GENERAL_ERROR(COUNT);
+
+	// Address range check
+	if (modbusCheckRangeU16(readIndex, readCount) || modbusCheckRangeU16(writeIndex, writeCount))
+		return MODBUS_GENERAL_ERROR(RANGE);
+
+	uint8_t dataLength = writeCount << 1;
+
+	if (modbusMasterAllocateRequest(status, 10 + dataLength))
+		return MODBUS_GENERAL_ERROR(ALLOC);
+
+	// Copy register values
+	for (uint8_t i = 0; i < (uint8_t)writeCount; i++)
+		modbusWBE(&status->request.pdu[10 + (i << 1)], values[i]);
+
+	status->request.pdu[0] = 23;
+	modbusWBE(&status->request.pdu[1], readIndex);
+	modbusWBE(&status->request.pdu[3], readCount);
+	modbusWBE(&status->request.pdu[5], writeIndex);
+	modbusWBE(&status->request.pdu[7], writeCount);
+	status->request.pdu[9] = dataLength;
+	return MODBUS_NO_ERROR();
+}
+
 #endif
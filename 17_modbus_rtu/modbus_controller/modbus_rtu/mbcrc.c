@@ -80,11 +80,42 @@ static const UCHAR aucCRCLo[] = {
     0x41, 0x81, 0x80, 0x40
 };
 
-USHORT
-usMBCRC16( const UCHAR * pucFrame, USHORT usLen )
+/* Slice-by-4 tables, built once by vMBCRC16Init.
+ * usCRCSlice[0] is the classic reflected table (poly 0xA001), entry k
+ * gives the CRC of a byte followed by k zero bytes.
+ */
+#define MB_CRC_SLICE_MIN        16      /*!< Shorter frames use the byte-wise loop. */
+static USHORT usCRCSlice[4][256];
+static BOOL   xCRCSliceReady;
+
+void
+vMBCRC16Init( void )
+{
+    USHORT          usCRC;
+
+    if( xCRCSliceReady )
+        return;
+    for( int i = 0; i < 256; i++ )
+    {
+        usCRC = ( USHORT )( aucCRCLo[i] << 8 | aucCRCHi[i] );
+        usCRCSlice[0][i] = usCRC;
+    }
+    for( int i = 0; i < 256; i++ )
+    {
+        for( int k = 1; k < 4; k++ )
+        {
+            usCRC = usCRCSlice[k - 1][i];
+            usCRCSlice[k][i] = ( usCRC >> 8 ) ^ usCRCSlice[0][usCRC & 0xFF];
+        }
+    }
+    xCRCSliceReady = TRUE;
+}
+
+static USHORT
+usMBCRC16Bytewise( USHORT usCRC, const UCHAR * pucFrame, USHORT usLen )
 {
-    UCHAR           ucCRCHi = 0xFF;
-    UCHAR           ucCRCLo = 0xFF;
+    UCHAR           ucCRCHi = ( UCHAR )( usCRC >> 8 );
+    UCHAR           ucCRCLo = ( UCHAR )( usCRC & 0xFF );
     int             iIndex;
 
     while( usLen-- )
@@ -95,3 +126,38 @@ usMBCRC16( const UCHAR * pucFrame, USHORT usLen )
     }
     return ( USHORT )( ucCRCHi << 8 | ucCRCLo );
 }
+
+/* Four bytes per step: the first two are folded into the CRC register,
+ * the last two only need the "followed by zero bytes" tables.
+ */
+static USHORT
+usMBCRC16Slice4( USHORT usCRC, const UCHAR * pucFrame, USHORT usLen )
+{
+    while( usLen >= 4 )
+    {
+        usCRC ^= ( USHORT )( pucFrame[0] | pucFrame[1] << 8 );
+        usCRC = usCRCSlice[3][usCRC & 0xFF] ^ usCRCSlice[2][usCRC >> 8] ^
+                usCRCSlice[1][pucFrame[2]] ^ usCRCSlice[0][pucFrame[3]];
+        pucFrame += 4;
+        usLen -= 4;
+    }
+    return usMBCRC16Bytewise( usCRC, pucFrame, usLen );
+}
+
+/* Continues a CRC over the next bytes of a frame, start with MB_CRC16_INIT.
+ * Feeding a whole frame, CRC included, ends on 0 if the frame is valid.
+ */
+USHORT
+usMBCRC16Update( USHORT usCRC, const UCHAR * pucFrame, USHORT usLen )
+{
+    /* Table walk setup only pays off on longer chunks */
+    if( xCRCSliceReady && usLen >= MB_CRC_SLICE_MIN )
+        return usMBCRC16Slice4( usCRC, pucFrame, usLen );
+    return usMBCRC16Bytewise( usCRC, pucFrame, usLen );
+}
+
+USHORT
+usMBCRC16( const UCHAR * pucFrame, USHORT usLen )
+{
+    return usMBCRC16Update( MB_CRC16_INIT, pucFrame, usLen );
+}
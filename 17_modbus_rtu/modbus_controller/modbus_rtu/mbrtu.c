@@ -39,44 +39,51 @@
 #include "Include/mbcrc.h"
 #include "Include/mb.h"
 #include "Include/mbrtu.h"
+#include "../modbus_bus.h"
+#include "trace/events/modbus.h"
 /* ----------------------- Defines ------------------------------------------*/
 #define MB_SER_PDU_SIZE_MIN     4       /*!< Minimum size of a Modbus RTU frame. */
-#define MB_SER_PDU_SIZE_MAX     256     /*!< Maximum size of a Modbus RTU frame. */
 #define MB_SER_PDU_SIZE_CRC     2       /*!< Size of CRC field in PDU. */
 #define MB_SER_PDU_ADDR_OFF     0       /*!< Offset of slave address in Ser-PDU. */
 #define MB_SER_PDU_PDU_OFF      1       /*!< Offset of Modbus-PDU in Ser-PDU. */
-#define MAX_PER_RECEIVE			MB_SER_PDU_SIZE_MAX		/*!< Maximun size of a number bytes reading per time. */
+#define MB_SER_EXCEPTION_SIZE   5       /*!< Address, function | 0x80, exception code and CRC. */
 
-/* ----------------------- Type definitions ---------------------------------*/
-typedef enum
+/* ----------------------- Start implementation -----------------------------*/
+/* Frame slot the receiver is filling */
+static xMBRTUFrame *
+pxMBRTURcvFrame( xMBRTUState * rtu )
 {
-    STATE_RX_INIT,              /*!< Receiver is in initial state. */
-    STATE_RX_IDLE,              /*!< Receiver is in idle state. */
-    STATE_RX_RCV,               /*!< Frame is beeing received. */
-    STATE_RX_ERROR              /*!< If the frame is invalid. */
-} eMBRcvState;
+    return &rtu->xRcvFrames[rtu->ulRcvHead & ( MB_RTU_RX_FRAMES - 1 )];
+}
 
-typedef enum
+static BOOL
+xMBRTUFrameComplete( xMBRTUState * rtu )
 {
-    STATE_TX_IDLE,              /*!< Transmitter is in idle state. */
-    STATE_TX_XMIT               /*!< Transmitter is in transfer state. */
-} eMBSndState;
-
-/* ----------------------- Static variables ---------------------------------*/
-static volatile eMBSndState eSndState;
-static volatile eMBRcvState eRcvState;
-
-static UCHAR  ucRTUReBuf[MB_SER_PDU_SIZE_MAX];
-static UCHAR ucRTUSndBuf[MB_SER_PDU_SIZE_MAX];
-
-static volatile USHORT usSndBufferCount;
-static volatile USHORT usSndBufferPos;
+    if( !rtu->usRcvExpected || ( rtu->usRcvCRC != 0 ) )
+        return FALSE;
+    if( rtu->usRcvBufferPos == rtu->usRcvExpected )
+        return TRUE;
+    /* Exception replies are shorter than any normal reply */
+    return ( rtu->usRcvBufferPos == MB_SER_EXCEPTION_SIZE )
+        && ( pxMBRTURcvFrame( rtu )->ucBuf[MB_SER_PDU_PDU_OFF] & 0x80 );
+}
 
-static volatile USHORT usRcvBufferPos;
+/* Hand the frame being received over to the master, the next one goes to the next slot */
+static BOOL
+xMBRTUFrameDeliver( struct modbus_bus * bus )
+{
+    xMBRTUState    *rtu = &bus->rtu;
+    xMBRTUFrame    *pxFrame = pxMBRTURcvFrame( rtu );
+
+    pxFrame->usLength = rtu->usRcvBufferPos;
+    pxFrame->usCRC = rtu->usRcvCRC;
+    /* Publish the frame content before the slot index */
+    smp_store_release( &rtu->ulRcvHead, rtu->ulRcvHead + 1 );
+    return xMBPortEventPost( bus, EV_FRAME_RECEIVED );
+}
 
-/* ----------------------- Start implementation -----------------------------*/
 eMBErrorCode
-eMBRTUInit(ULONG ulBaudRate)
+eMBRTUInit( struct modbus_bus * bus, ULONG ulBaudRate )
 {
     eMBErrorCode    eStatus = MB_ENOERR;
     ULONG           usTimerT35_50us;
@@ -101,7 +108,7 @@ eMBRTUInit(ULONG ulBaudRate)
 		 */
 		usTimerT35_50us = ( 7UL * 220000UL ) / ( 2UL * ulBaudRate );
 	}
-	if( xMBPortTimersInit( ( USHORT ) usTimerT35_50us ) != TRUE )
+	if( xMBPortTimersInit( bus, ( USHORT ) usTimerT35_50us ) != TRUE )
 	{
 		eStatus = MB_EPORTERR;
 	}
@@ -111,50 +118,65 @@ eMBRTUInit(ULONG ulBaudRate)
 }
 
 void
-eMBRTUStart( void )
+eMBRTUStart( struct modbus_bus * bus )
 {
+    xMBRTUState    *rtu = &bus->rtu;
+
     ENTER_CRITICAL_SECTION(  );
     /* Initially the receiver is in the state STATE_RX_INIT. we start
      * the timer and if no character is received within t3.5 we change
      * to STATE_RX_IDLE. This makes sure that we delay startup of the
      * modbus protocol stack until the bus is free.
      */
-	eRcvState = STATE_RX_INIT;
-	vMBPortTimersStart( );
-	register_modbus_callbacks(&xMBRTUTransmitSuccess,&xMBRTUReceiveFSM);
+	rtu->eRcvState = STATE_RX_INIT;
+	rtu->xRcvGap = TRUE;
+	vMBPortTimersStart( bus );
+	register_modbus_callbacks(bus, &xMBRTUTransmitSuccess, &xMBRTUReceiveFSM);
 	EXIT_CRITICAL_SECTION(  );
 }
 
 void
-eMBRTUStop( void )
+eMBRTUStop( struct modbus_bus * bus )
 {
 	ENTER_CRITICAL_SECTION(  );
-	timer_remove();
+	timer_remove(bus);
 	pr_info("ModBusRTU: Destroy sucessfully\n");
 	EXIT_CRITICAL_SECTION(  );
 }
 
+BOOL
+xMBRTUFramePending( struct modbus_bus * bus )
+{
+    xMBRTUState    *rtu = &bus->rtu;
+
+    return rtu->ulRcvTail != smp_load_acquire( &rtu->ulRcvHead );
+}
+
+/* The frame stays in its pool slot, the caller parses it in place and
+ * gives the slot back with vMBRTUReleaseFrame( ).
+ */
 eMBErrorCode
-eMBRTUReceive( UCHAR * pucRcvAddress, UCHAR * pucFrame, USHORT * pusLength )
+eMBRTUReceive( struct modbus_bus * bus, UCHAR * pucRcvAddress, const UCHAR ** pucFrame, USHORT * pusLength )
 {
+    xMBRTUState    *rtu = &bus->rtu;
+    xMBRTUFrame    *pxFrame = &rtu->xRcvFrames[rtu->ulRcvTail & ( MB_RTU_RX_FRAMES - 1 )];
 	eMBErrorCode    eStatus = MB_ENOERR;
 
 	ENTER_CRITICAL_SECTION(  );
 
-	if( ( usRcvBufferPos >= MB_SER_PDU_SIZE_MIN )
-		&& ( usMBCRC16( ( UCHAR * ) ucRTUReBuf, usRcvBufferPos ) == 0 ) )
+	if( ( pxFrame->usLength >= MB_SER_PDU_SIZE_MIN )
+		&& ( pxFrame->usCRC == 0 ) )
 	{
 		/* Save the address field. All frames are passed to the upper layed
 		 * and the decision if a frame is used is done there.
 		*/
-		*pucRcvAddress = ucRTUReBuf[MB_SER_PDU_ADDR_OFF];
+		*pucRcvAddress = pxFrame->ucBuf[MB_SER_PDU_ADDR_OFF];
 		 /* Total length of Modbus-PDU is Modbus-Serial-Line-PDU minus
 				 * size of address field and CRC checksum.
 		 */
-		*pusLength = ( USHORT )( usRcvBufferPos - MB_SER_PDU_PDU_OFF - MB_SER_PDU_SIZE_CRC );
-		 /* Copy from the start of the Modbus PDU to the caller. */
+		*pusLength = ( USHORT )( pxFrame->usLength - MB_SER_PDU_PDU_OFF - MB_SER_PDU_SIZE_CRC );
 		 /* PDU frame is star form 1, not 0 (RTU) padding */
-		uiPortMemcpy(pucFrame,(ucRTUReBuf+1),*(pusLength));
+		*pucFrame = &pxFrame->ucBuf[MB_SER_PDU_PDU_OFF];
 	}
 	else
 	{
@@ -165,70 +187,65 @@ eMBRTUReceive( UCHAR * pucRcvAddress, UCHAR * pucFrame, USHORT * pusLength )
 	return eStatus;
 }
 
+void
+vMBRTUReleaseFrame( struct modbus_bus * bus )
+{
+    xMBRTUState    *rtu = &bus->rtu;
+
+    /* Done with the slot content before the receiver may reuse it */
+    smp_store_release( &rtu->ulRcvTail, rtu->ulRcvTail + 1 );
+}
+
+/* The frame comes from the master ready to go (address, PDU and CRC), it is
+ * handed to serdev without a copy.
+ */
 eMBErrorCode
-eMBRTUSend( UCHAR ucSlaveAddress, const UCHAR * pucFrame, USHORT usLength )
+eMBRTUSend( struct modbus_bus * bus, const UCHAR * pucFrame, USHORT usLength )
 {
 	eMBErrorCode    eStatus = MB_ENOERR;
-	USHORT          usCRC16;
 
 	ENTER_CRITICAL_SECTION(  );
-	/* First add the slave address for first byte of RTU Frame */
-	ucRTUSndBuf[MB_SER_PDU_ADDR_OFF] = ucSlaveAddress;
-	usSndBufferCount = 1;
-
-	/* Copy usLength bytes from PDU (Protocol data unit) */
-	UINT8 num_cpy = uiPortMemcpy((ucRTUSndBuf+usSndBufferCount),pucFrame, usLength);
-	if (num_cpy == usLength)
+	if( usLength < MB_SER_PDU_SIZE_MIN || usLength > MB_SER_PDU_SIZE_MAX )
 	{
-		usSndBufferCount += usLength;
+		eStatus = MB_EINVAL;
 	}
 	else
 	{
-		eStatus = MB_EPORTERR;
-	}
-
-	/* Calculate CRC16 checksum for Modbus-Serial-Line-PDU. */
-	usCRC16 = usMBCRC16( ( UCHAR * ) ucRTUSndBuf, usSndBufferCount );
-
-	/* In frame description of MODBUSRTU, the CRC field includes 2 bytes oredered [CRC low, CRC high]
-	 * This oposite with PDU format (usually big endian format)
-	 * */
-	/* Activate the transmitter. */
-	pr_info ("Modbus request send\n");
-	ucRTUSndBuf[usSndBufferCount++] = ( UCHAR )( usCRC16 & 0xFF );
-	ucRTUSndBuf[usSndBufferCount++] = ( UCHAR )( usCRC16 >> 8 );
-	for (int i = 0; i < usSndBufferCount; i++)
-	{
-		pr_info ("Sndbuf[%d]: 0x%x\n",i,ucRTUSndBuf[i]);
+		/* Activate the transmitter. */
+		mb_dbg("Modbus request send, %u bytes\n", usLength);
+		bus->rtu.ucSndAddress = pucFrame[MB_SER_PDU_ADDR_OFF];
+		bus->rtu.ucSndFunction = pucFrame[MB_SER_PDU_PDU_OFF];
+		bus->rtu.usSndLength = usLength;
+		trace_modbus_rtu_send(bus, pucFrame[MB_SER_PDU_ADDR_OFF], pucFrame[MB_SER_PDU_PDU_OFF], usLength);
+		modbus_controller_write(bus, (char *)pucFrame, usLength);
 	}
-	modbus_controller_write(ucRTUSndBuf, usSndBufferCount);
     EXIT_CRITICAL_SECTION(  );
     return eStatus;
 }
 
+/* Called from the serdev receive callback with the bytes of the UART, they
+ * are copied once, straight into the frame slot being received.
+ */
 BOOL
-xMBRTUReceiveFSM( void )
+xMBRTUReceiveFSM( struct modbus_bus * bus, const UCHAR * pucData, USHORT usCount )
 {
+    xMBRTUState    *rtu = &bus->rtu;
     BOOL            xTaskNeedSwitch = FALSE;
-	UCHAR			ucRTUTmpBuf[MAX_PER_RECEIVE];
-	INT				usRTUReceiveCount;
-    /* Read the characters. */
-    ( void )modbus_controller_read(ucRTUTmpBuf,&usRTUReceiveCount);
 
-    switch ( eRcvState )
+    switch ( rtu->eRcvState )
     {
         /* If we have received a character in the init state we have to
          * wait until the frame is finished.
          */
     case STATE_RX_INIT:
-        vMBPortTimersStart(  );
+        vMBPortTimersStart( bus );
         break;
 
         /* In the error state we wait until all characters in the
          * damaged frame are transmitted.
          */
     case STATE_RX_ERROR:
-        vMBPortTimersStart(  );
+        vMBPortTimersStart( bus );
         break;
 
         /* In the idle state we wait for a new character. If a character
@@ -236,14 +253,29 @@ xMBRTUReceiveFSM( void )
          * receiver is in the state STATE_RX_RECEIVCE.
          */
     case STATE_RX_IDLE:
-		pr_info("Recive FSM: Recive first bytes\n");
-        usRcvBufferPos = 0;
-		uiPortMemcpy(ucRTUReBuf+usRcvBufferPos,ucRTUTmpBuf,usRTUReceiveCount);
-		usRcvBufferPos += usRTUReceiveCount;
-		pr_info("usRcvBufferPos:%d\n",usRcvBufferPos);
-        eRcvState = STATE_RX_RCV;
+		mb_dbg("Recive FSM: Recive first bytes\n");
+        /* The bus is busy, no request goes out before the next T3.5 silence */
+        rtu->xRcvGap = TRUE;
+        rtu->usRcvBufferPos = 0;
+        /* Every slot still holds a frame the master did not parse yet */
+        if( rtu->ulRcvHead - smp_load_acquire( &rtu->ulRcvTail ) >= MB_RTU_RX_FRAMES )
+        {
+			pr_err_ratelimited("Recive FSM: No free frame buffer, frame dropped\n");
+            rtu->eRcvState = STATE_RX_ERROR;
+            vMBPortTimersStart( bus );
+            break;
+        }
+        usCount = min_t( USHORT, usCount, MB_SER_PDU_SIZE_MAX );
+		trace_modbus_rx_start(bus, pucData[MB_SER_PDU_ADDR_OFF],
+							  usCount > MB_SER_PDU_PDU_OFF ? pucData[MB_SER_PDU_PDU_OFF] : 0, usCount);
+		memcpy(pxMBRTURcvFrame( rtu )->ucBuf, pucData, usCount);
+		rtu->usRcvBufferPos = usCount;
+		/* CRC runs along with the reception, the frame is checked once T3.5 expires */
+		rtu->usRcvCRC = usMBCRC16Update( MB_CRC16_INIT, pucData, usCount );
+		mb_dbg("usRcvBufferPos:%d\n",rtu->usRcvBufferPos);
+        rtu->eRcvState = STATE_RX_RCV;
         /* Enable t3.5 timers. */
-        vMBPortTimersStart(  );
+        vMBPortTimersStart( bus );
         break;
 
         /* We are currently receiving a frame. Reset the timer after
@@ -252,56 +284,108 @@ xMBRTUReceiveFSM( void )
          * ignored.
          */
     case STATE_RX_RCV:
-        if( usRcvBufferPos + usRTUReceiveCount < MB_SER_PDU_SIZE_MAX )
+        if( rtu->usRcvBufferPos + usCount <= MB_SER_PDU_SIZE_MAX )
         {
-			uiPortMemcpy(ucRTUReBuf+usRcvBufferPos,ucRTUTmpBuf,usRTUReceiveCount);
-			usRcvBufferPos += usRTUReceiveCount;
-			pr_info("usRcvBufferPos:%d\n",usRcvBufferPos);
-			eRcvState = STATE_RX_RCV;
+			memcpy(pxMBRTURcvFrame( rtu )->ucBuf + rtu->usRcvBufferPos, pucData, usCount);
+			rtu->usRcvBufferPos += usCount;
+			rtu->usRcvCRC = usMBCRC16Update( rtu->usRcvCRC, pucData, usCount );
+			mb_dbg("usRcvBufferPos:%d\n",rtu->usRcvBufferPos);
+			rtu->eRcvState = STATE_RX_RCV;
         }
         else
         {
 			pr_err("Recive FSM: Receive number of bytes exceed MAX\n");
-            eRcvState = STATE_RX_ERROR;
+            rtu->eRcvState = STATE_RX_ERROR;
         }
         break;
     }
+
+    /* Early frame end: the expected reply is complete and its CRC is valid,
+     * deliver it now instead of waiting for the T3.5 silence. The silence is
+     * still owed to the bus before the next request, T3.5 restarts from the
+     * last byte and its expiry lets the master send.
+     */
+    if( ( rtu->eRcvState == STATE_RX_RCV ) && xMBRTUFrameComplete( rtu ) )
+    {
+        vMBPortTimersCancel( bus );
+        /* T3.5 may have expired meanwhile and delivered the frame already */
+        if( rtu->eRcvState == STATE_RX_RCV )
+        {
+            rtu->usRcvExpected = 0;
+            rtu->eRcvState = STATE_RX_IDLE;
+            vMBPortTimersStart( bus );
+            xTaskNeedSwitch = xMBRTUFrameDeliver( bus );
+        }
+    }
     return xTaskNeedSwitch;
 }
 
+/* Length of the reply expected for the next request, 0 to always wait for T3.5.
+ * Set by the master right before the request is sent.
+ */
+void
+vMBRTUExpectFrame( struct modbus_bus * bus, USHORT usLength )
+{
+    bus->rtu.usRcvExpected = usLength;
+}
+
+/* TRUE once the bus has been silent for T3.5 since the last byte received,
+ * a request sent earlier would merge with the previous frame.
+ */
+BOOL
+xMBRTUBusSilent( struct modbus_bus * bus )
+{
+    return !READ_ONCE( bus->rtu.xRcvGap );
+}
+
 BOOL
-xMBRTUTransmitSuccess ( void )
+xMBRTUTransmitSuccess( struct modbus_bus * bus )
 {
 	/* Trigger successfull sent even */
-	xMBPortEventPost(EV_FRAME_SENT);
+	xMBPortEventPost( bus, EV_FRAME_SENT );
 	return TRUE;
 }
 
 BOOL
-xMBRTUTimerT35Expired( void )
+xMBRTUTimerT35Expired( struct modbus_bus * bus )
 {
+    xMBRTUState    *rtu = &bus->rtu;
     BOOL            xNeedPoll = FALSE;
 
-    switch ( eRcvState )
+    /* The bus is silent, cleared before the master is notified below */
+    WRITE_ONCE( rtu->xRcvGap, FALSE );
+    switch ( rtu->eRcvState )
     {
         /* Timer t35 expired. Startup phase is finished. */
     case STATE_RX_INIT:
-		xNeedPoll = xMBPortEventPost( EV_READY );
+		xNeedPoll = xMBPortEventPost( bus, EV_READY );
         break;
         /* A frame was received and t35 expired. Notify the listener that
          * a new frame was received. */
     case STATE_RX_RCV:
-        xNeedPoll = xMBPortEventPost( EV_FRAME_RECEIVED );
+		trace_modbus_t35_expired(bus, pxMBRTURcvFrame( rtu )->ucBuf[MB_SER_PDU_ADDR_OFF],
+								 pxMBRTURcvFrame( rtu )->ucBuf[MB_SER_PDU_PDU_OFF], rtu->usRcvBufferPos);
+        /* Ended by the silence, a late reply must not be matched against it */
+        rtu->usRcvExpected = 0;
+        xNeedPoll = xMBRTUFrameDeliver( bus );
         break;
 
-        /* An error occured while receiving the frame. */
+        /* An error occured while receiving the frame. The master may
+         * send again now.
+         */
     case STATE_RX_ERROR:
+		xNeedPoll = xMBPortEventPost( bus, EV_READY );
+        break;
+
+        /* Silence after a frame delivered on its expected length */
+    case STATE_RX_IDLE:
+		xNeedPoll = xMBPortEventPost( bus, EV_READY );
         break;
 
         /* Function called in an illegal state. */
     default:
 		break;
     }
-	eRcvState = STATE_RX_IDLE;
+	rtu->eRcvState = STATE_RX_IDLE;
     return xNeedPoll;
 }
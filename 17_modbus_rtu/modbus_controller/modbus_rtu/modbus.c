@@ -22,51 +22,70 @@
 
 #define LIGHTMODBUS_MASTER_FULL
 #define LIGHTMODBUS_IMPL
+#ifdef CONFIG_MODBUS_DEBUG_LOG
 #define LIGHTMODBUS_DEBUG
+#endif
 
+#include <linux/list.h>
+#include <linux/moduleparam.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/unaligned.h>
 #include "lightmodbus/lightmodbus.h"
 #include "Include/port.h"
 #include "Include/mb.h"
 #include "Include/mbport.h"
 #include "Include/mbrtu.h"
+#include "Include/mbcrc.h"
+#include "../modbus_bus.h"
+#include "trace/events/modbus.h"
 
 /* -------------------------------------------------------------------------- */
 /* Definitions									*/
 /* -------------------------------------------------------------------------- */
 
 #define MB_ADDRESS_BROADCAST 0
-#define MAX_PDU_SIZE         253
-#define MAX_VALUE_RESPONE	 10					/* We assume that no senosor hold value in more than 10 registers */
+#define MB_ADU_PDU_OFF		1		/* PDU offset in the request frame, after the address */
+#define MB_RTT_MIN_TIMEOUT	10		/* ms, default lower bound of the adaptive response timeout */
+#define MB_BREAKER_THRESHOLD	3		/* Consecutive timeouts that open the breaker of a slave */
+#define MB_BREAKER_BACKOFF		1000	/* ms, first open period, doubled by every failed probe */
+#define MB_BREAKER_BACKOFF_MAX	60000	/* ms */
 /* -------------------------------------------------------------------------
  * Meta Information & Global Variables
  * ------------------------------------------------------------------------- */
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Van Tien");
 
-/* -------------------------------------------------------------------------- */
-/* Global Variables                              */
-/* -------------------------------------------------------------------------- */
-/* Lock for master, only thread can use in time, 
- * migth be many threads from user try to read on modbus bus 
- * */
-DEFINE_MUTEX(master_lock); 
+static unsigned int rtt_min_timeout = MB_RTT_MIN_TIMEOUT;
+module_param(rtt_min_timeout, uint, 0644);
+MODULE_PARM_DESC(rtt_min_timeout, "Lower bound of the adaptive response timeout in ms");
 
-static ModbusMaster    master;
-static ModbusErrorInfo err          = MODBUS_NO_ERROR();
+static unsigned int breaker_threshold = MB_BREAKER_THRESHOLD;
+module_param(breaker_threshold, uint, 0644);
+MODULE_PARM_DESC(breaker_threshold, "Consecutive timeouts before a slave is considered down, 0 disables the breaker");
 
-static unsigned char     ucMBAddress;    /* Target Slave Address for current transaction */
-static int      baudrate;       /* Stored baudrate for RTU initialization */
+static unsigned int breaker_backoff = MB_BREAKER_BACKOFF;
+module_param(breaker_backoff, uint, 0644);
+MODULE_PARM_DESC(breaker_backoff, "First probe delay of a slave that is down, in ms");
 
-static uint16_t					usRspone[MAX_VALUE_RESPONE];	/* Buffer holding return respone for device (using on data call back) */
-static uint8_t					ubRspLength;						/* Length of return respone */				
-static unsigned char			pucMBFrame[MAX_PDU_SIZE];		/* Buffer holding value from RTU Layer before put it into step parsing */
-static uint16_t					usLength;
+static unsigned int breaker_backoff_max = MB_BREAKER_BACKOFF_MAX;
+module_param(breaker_backoff_max, uint, 0644);
+MODULE_PARM_DESC(breaker_backoff_max, "Longest probe delay of a slave that is down, in ms");
 
-DECLARE_WAIT_QUEUE_HEAD(send_wait_queue);
-static eMasterType     master_state = EM_IDLE;
-
-static eMBErrorCode    eStatus = MB_ENOERR;
-static eMBEventType    eEvent;
+/**
+ * @brief Logs a LightModbus error, by name when the debug tables are built in.
+ */
+static void modbus_report_error(const char *what, ModbusErrorInfo err)
+{
+#ifdef LIGHTMODBUS_DEBUG
+	pr_err("%s: %s(%s)\n", what,
+		modbusErrorSourceStr(modbusGetErrorSource(err)),
+		modbusErrorStr(modbusGetErrorCode(err)));
+#else
+	pr_err("%s: source %d, error %d\n", what,
+		modbusGetErrorSource(err), modbusGetErrorCode(err));
+#endif
+}
 
 /* -------------------------------------------------------------------------- */
 /* LightModbus Callbacks                          */
@@ -75,9 +94,12 @@ static eMBEventType    eEvent;
 /**
  * @brief Handles successfully parsed data from a Slave response.
  * If request read more than 1 register, this callback is called each time.
+ * Values are stored straight into the active transaction of the bus.
  */
 static ModbusError dataCallback(const ModbusMaster *master, const ModbusDataCallbackArgs *args)
 {
+	struct modbus_bus *bus = modbusMasterGetUserPointer(master);
+	struct modbus_xfer *xfer = bus->xfer_active;
     char typechar = '?';
     switch (args->type)
     {
@@ -86,14 +108,16 @@ static ModbusError dataCallback(const ModbusMaster *master, const ModbusDataCall
         case MODBUS_COIL:             typechar = 'C'; break;
         case MODBUS_DISCRETE_INPUT:   typechar = 'D'; break;
     }
-    pr_info(
+    mb_dbg(
         "F: %03d, T: %c, ID: %03d, VAL: 0x%04x (%d)\n",
         args->function,
         typechar,
         args->index,
         args->value,
         args->value);
-	usRspone[ubRspLength++] = args->value;
+	if (!xfer || !xfer->values || xfer->count >= xfer->quantity)
+		return MODBUS_ERROR_COUNT;
+	xfer->values[xfer->count++] = args->value;
     return MODBUS_OK;
 }
 
@@ -102,69 +126,87 @@ static ModbusError dataCallback(const ModbusMaster *master, const ModbusDataCall
  */
 static ModbusError exceptionCallback(const ModbusMaster *master, uint8_t address, uint8_t function, ModbusExceptionCode code)
 {
-    pr_info(
+	struct modbus_bus *bus = modbusMasterGetUserPointer(master);
+
+    mb_dbg(
         "EXCEPTION SLAVE: %03d, F: %03d, CODE: %03d\n",
         address,
         function,
         (int) code
         );
+	if (bus->xfer_active)
+		bus->xfer_active->exception = code;
     return MODBUS_OK;
 }
 
-/* -------------------------------------------------------------------------- */
-/* Internal Helper Functions                         */
-/* -------------------------------------------------------------------------- */
-
-static long send_and_wait_logic(int timeout, eMBEventType event)
+/**
+ * @brief Request allocator of the master, never touches the heap.
+ * The request is built straight into the frame storage of the transaction
+ * being prepared (bus->build_xfer, set under build_lock).
+ */
+static ModbusError xferAllocator(ModbusBuffer *buffer, uint16_t size, void *context)
 {
-    /* 1. Create a wait entry for the current process */
-    DEFINE_WAIT(wait);
-	/* Convert ms to kernel 'jiffies' (ticks) */
-    long timeout_jiffies = msecs_to_jiffies(timeout);
+	struct modbus_bus *bus = context;
 
-    /* 2. PREPARE: Add to queue and set state to TASK_INTERRUPTIBLE
-       This makes the process "ready to sleep" but doesn't yield the CPU yet. */
-    prepare_to_wait(&send_wait_queue, &wait, TASK_INTERRUPTIBLE);
-
-    /* 3. TRIGGER: Start the hardware/event
-       Even if an interrupt happens NOW and calls wake_up(),
-       your 'wait' entry is already in the queue. */
-    xMBPortEventPost(event);
-
-    /* 4. CHECK: Ensure the event didn't happen in the microsecond
-       between 'prepare' and 'trigger'. */
-    if (master_state != EM_PR && master_state != EM_PER) 
+	if (!size)
 	{
-        /* 5. SLEEP: Yield the CPU
-		 * If tasklet run (preempt current thread(call wake up), the thread state will change to TASK_RUNNING)
-		 * In that case, the schedule function will return imediatelly.
-		 * */
-		 timeout_jiffies = schedule_timeout(timeout_jiffies);  
-  	}
-
-    /* 6. CLEANUP: Set state back to TASK_RUNNING and remove from queue */
-	__set_current_state(TASK_RUNNING);
-    finish_wait(&send_wait_queue, &wait);
-	return timeout_jiffies;
+		buffer->data = NULL;
+		return MODBUS_OK;
+	}
+	if (!bus->build_xfer || size > MODBUS_MAX_PDU)
+		return MODBUS_ERROR_ALLOC;
+	buffer->data = bus->build_xfer->adu + MB_ADU_PDU_OFF;
+	return MODBUS_OK;
 }
 
+/* -------------------------------------------------------------------------- */
+/* Internal Helper Functions                         */
+/* -------------------------------------------------------------------------- */
+
 /**
  * @brief Formats the Modbus PDU using LightModbus builder functions.
+ * FC15 takes one value per coil in @write_values, packed into bits here.
  */
-static int buildreq(ModbusMaster *master, int function, int startAddress, int quantity)
+static int buildreq(ModbusMaster *master, const struct modbus_xfer *xfer)
 {
-    switch (function)
+	ModbusErrorInfo err = MODBUS_GENERAL_ERROR(FUNCTION);
+	uint8_t coils[DIV_ROUND_UP(MODBUS_MAX_WRITE_COILS, 8)];
+
+    switch (xfer->function)
     {
         case 1:
         case 2:
         case 3:
         case 4:
-            err = modbusBuildRequest01020304(master, function, startAddress, quantity);
+            err = modbusBuildRequest01020304(master, xfer->function, xfer->start, xfer->quantity);
             break;
 
         case 5:
         case 6:
-            err = modbusBuildRequest0506(master, function, startAddress, quantity);
+            err = modbusBuildRequest0506(master, xfer->function, xfer->start, xfer->quantity);
+            break;
+
+        case 15:
+            if (!xfer->write_values || xfer->quantity > MODBUS_MAX_WRITE_COILS)
+                break;
+            memset(coils, 0, DIV_ROUND_UP(xfer->quantity, 8));
+            for (int i = 0; i < xfer->quantity; i++)
+                if (xfer->write_values[i])
+                    coils[i / 8] |= 1 << (i % 8);
+            err = modbusBuildRequest15(master, xfer->start, xfer->quantity, coils);
+            break;
+
+        case 16:
+            if (!xfer->write_values)
+                break;
+            err = modbusBuildRequest16(master, xfer->start, xfer->quantity, xfer->write_values);
+            break;
+
+        case 23:
+            if (!xfer->write_values)
+                break;
+            err = modbusBuildRequest23(master, xfer->start, xfer->quantity,
+                                       xfer->write_start, xfer->write_quantity, xfer->write_values);
             break;
 
         default:
@@ -174,26 +216,371 @@ static int buildreq(ModbusMaster *master, int function, int startAddress, int qu
 
     if (!modbusIsOk(err))
     {
-        pr_err("Error building request: %s(%s)\n",
-            modbusErrorSourceStr(modbusGetErrorSource(err)),
-            modbusErrorStr(modbusGetErrorCode(err)));
+        modbus_report_error("Error building request", err);
 		return 1;
     }
 	return 0;
 }
 
+/**
+ * @brief Hands one finished transaction back to its owner.
+ */
+static void xfer_done(struct modbus_xfer *xfer, SendRetType status)
+{
+	trace_modbus_xfer_done(xfer, status);
+	xfer->status = status;
+	if (xfer->complete)
+		xfer->complete(xfer);
+	else
+		complete(&xfer->done);
+}
+
+/**
+ * @brief Hands a finished transaction and the reads sharing it back to their owners.
+ * @xfer must already be off the queue and not active, so no follower can
+ * attach to it anymore.
+ */
+static void xfer_complete(struct modbus_bus *bus, struct modbus_xfer *xfer, SendRetType status)
+{
+	struct modbus_xfer *follower, *tmp;
+	LIST_HEAD(followers);
+
+	spin_lock_bh(&bus->xfer_lock);
+	list_splice_init(&xfer->followers, &followers);
+	spin_unlock_bh(&bus->xfer_lock);
+
+	/* Followers get a copy of the result, before the owner of @xfer may reuse it */
+	list_for_each_entry_safe(follower, tmp, &followers, node)
+	{
+		list_del_init(&follower->node);
+		if (follower->values && xfer->values)
+			memcpy(follower->values, xfer->values, xfer->count * sizeof(*xfer->values));
+		follower->count = xfer->count;
+		follower->exception = xfer->exception;
+		xfer_done(follower, status);
+	}
+	xfer_done(xfer, status);
+}
+
+/**
+ * @brief Tells if two transactions are the same read, so one can share the result of the other.
+ */
+static bool xfer_same_read(const struct modbus_xfer *a, const struct modbus_xfer *b)
+{
+	if (a->function < 1 || a->function > 4)
+		return false;
+	/* The frame starts with the address */
+	return a->adu_len == b->adu_len && !memcmp(a->adu, b->adu, a->adu_len);
+}
+
+/**
+ * @brief Finds a queued or running read identical to @xfer.
+ * Called with xfer_lock held.
+ */
+static struct modbus_xfer *xfer_find_leader(struct modbus_bus *bus, const struct modbus_xfer *xfer)
+{
+	struct modbus_xfer *leader;
+
+	if (bus->xfer_active && xfer_same_read(bus->xfer_active, xfer))
+		return bus->xfer_active;
+	list_for_each_entry(leader, &bus->xfer_queue, node)
+	{
+		if (xfer_same_read(leader, xfer))
+			return leader;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Finishes the active transaction of the bus.
+ * The bus is free again when this returns.
+ */
+static void xfer_finish(struct modbus_bus *bus, SendRetType status)
+{
+	struct modbus_xfer *xfer = bus->xfer_active;
+
+	/* A stale timer run is filtered by rsp_deadline, no need to wait for it */
+	hrtimer_try_to_cancel(&bus->rsp_timer);
+	spin_lock(&bus->xfer_lock);
+	bus->xfer_active = NULL;
+	spin_unlock(&bus->xfer_lock);
+	bus->master_state = EM_IDLE;
+	xfer_complete(bus, xfer, status);
+}
+
+/**
+ * @brief Length of the RTU reply to a transaction, 0 if it can not be known.
+ * address + function + byte count + data + CRC for reads, echo of the request for FC05/FC06.
+ */
+static USHORT xfer_reply_length(const struct modbus_xfer *xfer)
+{
+	switch (xfer->function)
+	{
+		case 1:
+		case 2:
+			return 5 + DIV_ROUND_UP(xfer->quantity, 8);
+		case 3:
+		case 4:
+			return 5 + 2 * xfer->quantity;
+		case 5:
+		case 6:
+		case 15:
+		case 16:
+			return 8;
+		case 23:
+			return 5 + 2 * xfer->quantity;
+	}
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Slave round trip time and health                   */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Feeds one round trip time sample to the estimator of a slave.
+ * Same filter as TCP (RFC 6298): gain 1/8 for SRTT and 1/4 for RTTVAR.
+ */
+static void rtt_sample(struct modbus_slave *slave, uint32_t sample_us)
+{
+	uint32_t srtt = slave->srtt_us;
+	uint32_t rttvar = slave->rttvar_us;
+
+	sample_us = max_t(uint32_t, sample_us, 1);
+	if (!srtt)
+	{
+		srtt = sample_us;
+		rttvar = sample_us / 2;
+	}
+	else
+	{
+		uint32_t delta = sample_us > srtt ? sample_us - srtt : srtt - sample_us;
+
+		rttvar = rttvar - rttvar / 4 + delta / 4;
+		srtt = srtt - srtt / 8 + sample_us / 8;
+	}
+	WRITE_ONCE(slave->rttvar_us, rttvar);
+	WRITE_ONCE(slave->srtt_us, max_t(uint32_t, srtt, 1));
+}
+
+/**
+ * @brief Response timeout for a slave: SRTT + 4 * RTTVAR, clamped between
+ * rtt_min_timeout and @timeout. Without an estimate the full @timeout is used.
+ * @params
+ *	-slave: The slave
+ *	-timeout: Upper bound in ms, the timeout configured by the caller
+ * @return The timeout in us
+ */
+static uint32_t rtt_timeout(const struct modbus_slave *slave, uint32_t timeout)
+{
+	uint64_t max_us = (uint64_t)timeout * USEC_PER_MSEC;
+	uint64_t min_us = (uint64_t)READ_ONCE(rtt_min_timeout) * USEC_PER_MSEC;
+	uint64_t srtt = READ_ONCE(slave->srtt_us);
+	uint64_t rto;
+
+	max_us = min_t(uint64_t, max_us, U32_MAX);
+	if (!srtt)
+		return max_us;
+	rto = srtt + 4 * (uint64_t)READ_ONCE(slave->rttvar_us);
+	return clamp(rto, min(min_us, max_us), max_us);
+}
+
+/**
+ * @brief Circuit breaker of a slave, decides if a transaction may use the bus.
+ * Once the open period is over the breaker goes half-open and lets the
+ * transaction through as a probe.
+ * @return true if the transaction must fail without touching the bus
+ */
+static bool slave_reject(struct modbus_slave *slave)
+{
+	if (slave->breaker != MODBUS_BREAKER_OPEN)
+		return false;
+	if (ktime_before(ktime_get(), slave->retry_at))
+		return true;
+	WRITE_ONCE(slave->breaker, MODBUS_BREAKER_HALF_OPEN);
+	return false;
+}
+
+/**
+ * @brief The slave answered, whatever the content of the reply.
+ */
+static void slave_alive(struct modbus_slave *slave, uint8_t address)
+{
+	if (slave->breaker != MODBUS_BREAKER_CLOSED)
+		pr_info("Modbus slave %u: Answering again\n", address);
+	WRITE_ONCE(slave->failures, 0);
+	WRITE_ONCE(slave->backoff, 0);
+	WRITE_ONCE(slave->breaker, MODBUS_BREAKER_CLOSED);
+}
+
+/**
+ * @brief The slave did not answer within its timeout.
+ * Opens the breaker after breaker_threshold timeouts in a row, a failed
+ * probe opens it again for twice as long.
+ */
+static void slave_timeout(struct modbus_slave *slave, uint8_t address)
+{
+	uint32_t threshold = READ_ONCE(breaker_threshold);
+	uint32_t backoff;
+
+	/* The slave may just have slowed down, wait the full timeout and measure again */
+	WRITE_ONCE(slave->srtt_us, 0);
+	if (address == MB_ADDRESS_BROADCAST)
+		return;
+	WRITE_ONCE(slave->failures, slave->failures + 1);
+
+	if (slave->breaker == MODBUS_BREAKER_HALF_OPEN)
+		backoff = min_t(uint64_t, (uint64_t)slave->backoff * 2, READ_ONCE(breaker_backoff_max));
+	else if (threshold && slave->failures >= threshold)
+		backoff = READ_ONCE(breaker_backoff);
+	else
+		return;
+
+	backoff = max_t(uint32_t, backoff, 1);
+	if (slave->breaker == MODBUS_BREAKER_CLOSED)
+		pr_warn("Modbus slave %u: Down after %u timeouts\n", address, slave->failures);
+	slave->retry_at = ktime_add_ms(ktime_get(), backoff);
+	WRITE_ONCE(slave->backoff, backoff);
+	WRITE_ONCE(slave->breaker, MODBUS_BREAKER_OPEN);
+}
+
+/**
+ * @brief Puts the next queued transaction on the bus, if any.
+ * Called from the tasklet each time the bus becomes idle, so requests
+ * go out back to back right after the T3.5 silence of the previous reply.
+ */
+static void xfer_start_next(struct modbus_bus *bus)
+{
+	struct modbus_xfer *xfer;
+
+	/* RTU framing, wait for the T3.5 silence after the last reply (EV_READY) */
+	if (!xMBRTUBusSilent(bus))
+		return;
+
+	for (;;)
+	{
+		spin_lock(&bus->xfer_lock);
+		xfer = list_first_entry_or_null(&bus->xfer_queue, struct modbus_xfer, node);
+		if (xfer)
+		{
+			list_del_init(&xfer->node);
+			/* A slave that is down must not hold the bus for its timeout */
+			if (!slave_reject(&bus->slave[xfer->address]))
+			{
+				bus->xfer_active = xfer;
+				/*
+				 * Absolute deadline, not rounded up to the next jiffy. Armed under
+				 * the lock, so no timer is armed after ModbusDestroy() closed the queue.
+				 */
+				bus->rsp_sent = ktime_get();
+				bus->rsp_deadline = ktime_add_us(bus->rsp_sent,
+												 rtt_timeout(&bus->slave[xfer->address], xfer->timeout));
+				hrtimer_start(&bus->rsp_timer, bus->rsp_deadline, HRTIMER_MODE_ABS);
+			}
+		}
+		spin_unlock(&bus->xfer_lock);
+		if (!xfer)
+			return;
+		if (bus->xfer_active == xfer)
+			break;
+		xfer_complete(bus, xfer, ESEND_HOSTDOWN);
+	}
+	trace_modbus_xfer_start(xfer);
+
+	mb_dbg("MBMasterPoll: Modbus master request send\n");
+	bus->master_state = EM_WFR;
+	/* Let the RTU layer deliver the reply as soon as it is complete */
+	vMBRTUExpectFrame(bus, bus->early_frame_end ? xfer_reply_length(xfer) : 0);
+	/* Dispatch via RTU Link Layer, the frame is ready to go */
+	eMBRTUSend(bus, xfer->adu, xfer->adu_len);
+}
+
+/**
+ * @brief Response timer, only wakes the tasklet which checks the deadline.
+ */
+static enum hrtimer_restart rsp_timer_expired(struct hrtimer *timer)
+{
+	struct modbus_bus *bus = container_of(timer, struct modbus_bus, rsp_timer);
+
+	vMBPortEventKick(bus);
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * @brief Register block replies (FC03, FC04, FC23) decoded in one pass.
+ * The reply is validated once, then the big-endian registers are swapped
+ * straight into xfer->values, without a dataCallback per register.
+ * @return FALSE if the reply is not a plain register block of @xfer
+ *	(exception, other function), the generic parser handles it then
+ */
+static BOOL xfer_decode_registers(struct modbus_xfer *xfer, const UCHAR *pucFrame, USHORT usLength,
+								  SendRetType *status)
+{
+	USHORT usBytes = 2 * xfer->quantity;
+
+	if (xfer->function != 3 && xfer->function != 4 && xfer->function != 23)
+		return FALSE;
+	if (usLength < 1 || pucFrame[0] != xfer->function)
+		return FALSE;
+
+	if (!xfer->values || usLength != 2 + usBytes || pucFrame[1] != usBytes)
+	{
+		pr_err("Invalid register block reply, %u bytes for %u registers\n", usLength, xfer->quantity);
+		*status = ESEND_RPINVAL;
+		return TRUE;
+	}
+	for (int i = 0; i < xfer->quantity; i++)
+		xfer->values[i] = get_unaligned_be16(&pucFrame[2 + 2 * i]);
+	xfer->count = xfer->quantity;
+	*status = ESEND_NOERR;
+	return TRUE;
+}
+
+/**
+ * @brief Parses the received PDU against the active transaction.
+ * The PDU is still in its receive frame buffer, the values go straight to xfer->values.
+ */
+static SendRetType xfer_parse_reply(struct modbus_bus *bus, struct modbus_xfer *xfer,
+									const UCHAR *pucFrame, USHORT usLength)
+{
+	ModbusErrorInfo err;
+	SendRetType status;
+
+	mb_dbg("usLength:%d\n",usLength);
+	if (xfer_decode_registers(xfer, pucFrame, usLength, &status))
+		return status;
+	err = modbusParseResponsePDU(&bus->master,
+						  xfer->address,
+						  xfer->adu + MB_ADU_PDU_OFF,
+						  xfer->pdu_len,
+						  pucFrame,
+						  usLength);
+	if (!modbusIsOk(err))
+	{
+		modbus_report_error("Error parsing request", err);
+		return ESEND_RPINVAL;
+	}
+	if (xfer->exception)
+		return ESEND_RPINVAL;
+	mb_dbg("Response parsing successfully\n");
+	return ESEND_NOERR;
+}
+
 /**
  * @brief Main State Machine for Modbus Master. 
  * Handles Event dispatching and State transitions.
  */
-static eMBErrorCode eMBMasterPoll( void )
+static eMBErrorCode eMBMasterPoll( struct modbus_bus *bus )
 {
     char            Poll_log[17] = "MBMasterPoll"; 
+	eMBErrorCode    eStatus = MB_ENOERR;
+	eMBEventType    eEvent;
+	ktime_t         xEventTime;		/* Post time of eEvent */
 
-    pr_info("%s: Event trigger\n", Poll_log);
+    mb_dbg("%s: Event trigger\n", Poll_log);
 
-    /* Check for events from the porting layer (Timer/Serial) */
-    if( xMBPortEventGet( &eEvent ) == TRUE )
+    /* Drain all events from the porting layer (Timer/Serial) in one pass */
+    while( xMBPortEventGet( bus, &eEvent, &xEventTime ) == TRUE )
     {
         switch ( eEvent )
         {
@@ -201,59 +588,69 @@ static eMBErrorCode eMBMasterPoll( void )
                 break;
 
             case EV_MASTER_SEND_REQUEST:
-                if(master_state != EM_IDLE)
-                {
-                    pr_err("%s: Something go wrong, previous request haven't completely handled\n", Poll_log);
-                    eStatus = MB_EINVAL;
-                }
-                else
-                {
-                    pr_info("%s: Modbus master request send\n", Poll_log);
-                    /* Dispatch via RTU Link Layer */
-                    eMBRTUSend(
-                        ucMBAddress,
-                        modbusMasterGetRequest(&master),
-                        modbusMasterGetRequestLength(&master)
-                    ); 
-                    master_state = EM_WFR;
-                }
+				/* Queued transactions are started below */
                 break;
 
             case EV_FRAME_RECEIVED:
-                /* Validation: Only accept frames when waiting for a reply */
-				unsigned char ucRcvAddress;
-                if(master_state != EM_WFR)
-                {
-                    pr_err("%s: EV_FRAME_RECEIVED: Unexpected frame, master not in WFR state\n", Poll_log);
-                    eStatus = MB_EINVAL;
-                }
-                else
-                {
-                    pr_info("%s: EV_FRAME_RECEIVED: Received frame\n", Poll_log);
-                    eStatus = eMBRTUReceive( &ucRcvAddress, pucMBFrame, &usLength );
-					if (ucRcvAddress != ucMBAddress)
+				/* Every frame waiting in the receive pool, an event may cover several */
+				while (xMBRTUFramePending(bus))
+				{
+					unsigned char ucRcvAddress;
+					const UCHAR *pucFrame;
+					USHORT usLength;
+
+					eStatus = eMBRTUReceive( bus, &ucRcvAddress, &pucFrame, &usLength );
+					if (eStatus == MB_ENOERR)
+						trace_modbus_frame_received(bus, ucRcvAddress, usLength ? pucFrame[0] : 0, usLength,
+													ktime_us_delta(ktime_get(), xEventTime));
+					/* Validation: Only accept frames when waiting for a reply */
+					if(bus->master_state != EM_WFR)
+					{
+						pr_err("%s: EV_FRAME_RECEIVED: Unexpected frame, master not in WFR state\n", Poll_log);
+						eStatus = MB_EINVAL;
+					}
+					else if( eStatus != MB_ENOERR )
+					{
+						bus->master_state = EM_PER; /* Move to Processing Error Reply */
+						xfer_finish(bus, ESEND_RPINVAL);
+					}
+					else if (ucRcvAddress != bus->xfer_active->address)
 					{
-						pr_info("%s: EV_FRAME_RECEIVED: Invalid address\n", Poll_log);
-						master_state = EM_PER; /* Move to Processing Error Reply */
+						/* Not our slave, keep waiting until the deadline */
+						mb_dbg("%s: EV_FRAME_RECEIVED: Invalid address\n", Poll_log);
 					}
 					else
 					{
-						for(int i = 0; i < usLength; i++)
-						{
-							pr_info("pucMBFrame[%d]=0x%x\n",i,pucMBFrame[i]);
-						}
-						if( eStatus == MB_ENOERR )
-						{
-							master_state = EM_PR; /* Move to Processing Reply */
-						}
+						mb_dbg("%s: EV_FRAME_RECEIVED: Received frame, posted %lld us ago\n", Poll_log,
+								ktime_us_delta(ktime_get(), xEventTime));
+						mb_dbg("pucMBFrame[%u]=%*ph\n", usLength, min_t(int, usLength, 64), pucFrame);
+						rtt_sample(&bus->slave[ucRcvAddress], ktime_us_delta(xEventTime, bus->rsp_sent));
+						slave_alive(&bus->slave[ucRcvAddress], ucRcvAddress);
+						bus->master_state = EM_PR; /* Move to Processing Reply */
+						xfer_finish(bus, xfer_parse_reply(bus, bus->xfer_active, pucFrame, usLength));
 					}
-                }
-				wake_up_interruptible(&send_wait_queue);
+					/* Parsed in place, the receiver may reuse the buffer now */
+					vMBRTUReleaseFrame(bus);
+				}
                 break;
             default:
                 break;
         }
     }
+
+	/* Response timeout of the active transaction */
+	if (bus->master_state == EM_WFR && !ktime_before(ktime_get(), bus->rsp_deadline))
+	{
+		mb_dbg("%s: Request timeout\n", Poll_log);
+		/* A late reply must wait for T3.5, not match the expected length */
+		vMBRTUExpectFrame(bus, 0);
+		slave_timeout(&bus->slave[bus->xfer_active->address], bus->xfer_active->address);
+		xfer_finish(bus, ESEND_TIMEOUT);
+	}
+
+	/* Bus is free, start the next queued transaction */
+	if (bus->master_state == EM_IDLE)
+		xfer_start_next(bus);
     return eStatus;
 }
 
@@ -262,124 +659,357 @@ static eMBErrorCode eMBMasterPoll( void )
 /* -------------------------------------------------------------------------- */
 
 /**
- * @brief Initializes the LightModbus Master stack and stores configuration.
+ * @brief Initializes the LightModbus Master stack of a bus.
  */
-bool ModbusInit(int baud)
+bool ModbusInit(struct modbus_bus *bus, int baud)
 {
     ModbusErrorInfo err = modbusMasterInit(
-        &master,
+        &bus->master,
         dataCallback,
         exceptionCallback,
-        modbusDefaultAllocator,
+        xferAllocator,
         modbusMasterDefaultFunctions,
         modbusMasterDefaultFunctionCount);
 
     if (!modbusIsOk(err)) return FALSE;
+	/* Callbacks find their bus through the master user pointer */
+	modbusMasterSetUserPointer(&bus->master, bus);
+
+	mutex_init(&bus->build_lock);
+	INIT_LIST_HEAD(&bus->xfer_queue);
+	spin_lock_init(&bus->xfer_lock);
+	bus->master_state = EM_IDLE;
     
     pr_info("ModBus: Init Master successfully\n");
-    baudrate = baud;
+    bus->baudrate = baud;
     return TRUE;
 }
 
 /**
  * @brief Initializes the Porting Layer (RTU/Serial/Timer) and starts the stack.
  */
-bool ModbusStart(void)
+bool ModbusStart(struct modbus_bus *bus)
 {
-    eMBErrorCode eStatus = eMBRTUInit(baudrate);
+    eMBErrorCode eStatus = eMBRTUInit(bus, bus->baudrate);
     if (eStatus != MB_ENOERR) return FALSE;
-    xMBPortEventInit();
-    eMBRTUStart();
+	hrtimer_init(&bus->rsp_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	bus->rsp_timer.function = &rsp_timer_expired;
+    xMBPortEventInit(bus);
+    eMBRTUStart(bus);
+	spin_lock_bh(&bus->xfer_lock);
+	bus->xfer_accept = true;
+	spin_unlock_bh(&bus->xfer_lock);
     return TRUE;
 }
 
 /**
- * @brief Frees resources and stops the Modbus stack.
+ * @brief Frees resources and stops the Modbus stack of a bus.
+ * Transactions still queued or on the bus are completed with ESEND_CANCELED.
  */
-void ModbusDestroy(void)
+void ModbusDestroy(struct modbus_bus *bus)
 {
-    modbusMasterDestroy(&master);
-    eMBRTUStop();
-    vMBPortEventDeinit();
+	struct modbus_xfer *xfer, *tmp;
+	LIST_HEAD(canceled);
+
+	/* 1. Refuse new transactions, take the pending ones */
+	spin_lock_bh(&bus->xfer_lock);
+	bus->xfer_accept = false;
+	list_splice_init(&bus->xfer_queue, &canceled);
+	spin_unlock_bh(&bus->xfer_lock);
+
+	/*
+	 * 2. Stop everything that could run the tasklet. The serdev is closed
+	 * already, the response timer is only armed with the queue open (see
+	 * xfer_start_next()), so killing the tasklet last catches every kick.
+	 */
+    eMBRTUStop(bus);
+	hrtimer_cancel(&bus->rsp_timer);
+    vMBPortEventDeinit(bus);
+
+	/* 3. Hand back the cancelled transactions */
+	if (bus->xfer_active)
+		list_add(&bus->xfer_active->node, &canceled);
+	bus->xfer_active = NULL;
+	bus->master_state = EM_IDLE;
+	list_for_each_entry_safe(xfer, tmp, &canceled, node)
+	{
+		list_del_init(&xfer->node);
+		xfer_complete(bus, xfer, ESEND_CANCELED);
+	}
+
+    modbusMasterDestroy(&bus->master);
     pr_info("ModBus: Destroy successfully\n");
 }
 
 /**
  * @brief Will be call from tasklet handler. 
  */
-void ModbusRun(void)
+void ModbusRun(struct modbus_bus *bus)
 {
-    eMBMasterPoll();
+    eMBMasterPoll(bus);
 }
 
 /**
- * @brief Higher-level API to initiate a Modbus request.
+ * @brief Tells if the request frame of a read is still the one of its parameters.
+ * Polled reads are submitted over and over with the same parameters, their
+ * frame is built and CRC-stamped once. Writes carry data, they are always built.
  */
-SendRetType ModbusSend(char Address, int function, int startAddress, int quantity, int timeout)
+static bool xfer_adu_valid(const struct modbus_xfer *xfer)
 {
-	int ret_val = ESEND_NOERR;
-	/* 0. Accquire the master lock*/
-	mutex_lock(&master_lock);
-	ubRspLength = 0; /* Reset response length before start read */
-    /* 1. Build the PDU (Application Layer) */
-    if(buildreq(&master, function, startAddress, quantity))
+	const uint8_t *pdu = xfer->adu + MB_ADU_PDU_OFF;
+
+	if (xfer->function < 1 || xfer->function > 4 || xfer->pdu_len != 5 ||
+			xfer->adu_len != MB_ADU_PDU_OFF + 5 + 2)
+		return false;
+	return xfer->adu[0] == xfer->address && pdu[0] == xfer->function &&
+		   get_unaligned_be16(&pdu[1]) == xfer->start &&
+		   get_unaligned_be16(&pdu[3]) == xfer->quantity;
+}
+
+/**
+ * @brief Builds the request frame of a transaction and resets its result fields.
+ * The PDU is written in place into xfer->adu, see xferAllocator(), then
+ * framed with the address and the CRC. Nothing is rebuilt if the frame is
+ * still valid, see xfer_adu_valid().
+ * @return 0, or -EINVAL if the request can not be built
+ */
+static int xfer_prepare(struct modbus_bus *bus, struct modbus_xfer *xfer)
+{
+	int ret_val = 0;
+	uint16_t crc;
+
+	/* 1. Build the PDU (Application Layer) */
+	if (!xfer_adu_valid(xfer))
 	{
-		ret_val = ESEND_RQINVAL;	
-		goto out;
+		xfer->adu_len = 0;
+		mutex_lock(&bus->build_lock);
+		bus->build_xfer = xfer;
+		if (buildreq(&bus->master, xfer))
+			ret_val = -EINVAL;
+		else
+			xfer->pdu_len = modbusMasterGetRequestLength(&bus->master);
+		/* Detach the master from xfer->adu */
+		modbusMasterFreeRequest(&bus->master);
+		bus->build_xfer = NULL;
+		mutex_unlock(&bus->build_lock);
+		if (ret_val)
+			return ret_val;
+
+		/* 1.5. Frame it (Link Layer), CRC low byte first */
+		xfer->adu[0] = xfer->address;
+		crc = usMBCRC16(xfer->adu, MB_ADU_PDU_OFF + xfer->pdu_len);
+		xfer->adu[MB_ADU_PDU_OFF + xfer->pdu_len] = crc & 0xFF;
+		xfer->adu[MB_ADU_PDU_OFF + xfer->pdu_len + 1] = crc >> 8;
+		xfer->adu_len = MB_ADU_PDU_OFF + xfer->pdu_len + 2;
 	}
-    
-    /* 2. Cache metadata for the upcoming response validation */
-    ucMBAddress = Address;
-
-    /* 3. Prepare and wating to recive or timeout*/
-	pr_info("ModbusSend: waiting\n");
-	long timeout_jiffies = send_and_wait_logic(timeout, EV_MASTER_SEND_REQUEST);
-    /* 4.  Process continues here after wake-up
-	 * Parsing to read input 	
-	 * Application Layer: Parse the received PDU
-	 * */
-	if (timeout_jiffies == 0)
+
+	/* 2. Reset the result fields */
+	INIT_LIST_HEAD(&xfer->node);
+	INIT_LIST_HEAD(&xfer->followers);
+	init_completion(&xfer->done);
+	xfer->count = 0;
+	xfer->exception = 0;
+	xfer->status = ESEND_NOERR;
+	return 0;
+}
+
+/**
+ * modbus_submit - Queues a transaction on a bus
+ * @bus: Bus of the slave, see modbus_bus_from_device()
+ * @xfer: Transaction, address/function/start/quantity/timeout/values, the
+ *        write_* fields for FC15/FC16/FC23 and complete/context set by the caller
+ *
+ * Must be called from process context. The request PDU is built here, so a
+ * bad request is reported at once and nothing is queued. Otherwise the
+ * transaction is completed exactly once, through @xfer->complete or
+ * @xfer->done, with its result in @xfer->status.
+ *
+ * A read (FC01 - FC04) identical to one already queued or on the bus is
+ * not sent again: it completes with a copy of the result of the first one,
+ * whose timeout then applies to both.
+ *
+ * Return: 0 if queued, -EINVAL for an invalid request, -ESHUTDOWN if the bus is stopped
+ */
+int modbus_submit(struct modbus_bus *bus, struct modbus_xfer *xfer)
+{
+	struct modbus_xfer *leader;
+
+	/* 1. Build the request */
+	if (xfer_prepare(bus, xfer))
+		return -EINVAL;
+
+	/* 2. Queue and let the tasklet pick it up */
+	spin_lock_bh(&bus->xfer_lock);
+	if (!bus->xfer_accept)
 	{
-		/* Internal timer woke you up */
-		pr_info("Modbus Send: Request timeout\n");	
-		ret_val = ESEND_TIMEOUT;
+		spin_unlock_bh(&bus->xfer_lock);
+		return -ESHUTDOWN;
 	}
-	else
+	/* Same read already queued or on the bus, share its result instead of reading again */
+	leader = xfer_find_leader(bus, xfer);
+	if (leader)
+	{
+		list_add_tail(&xfer->node, &leader->followers);
+		trace_modbus_xfer_queue(xfer);
+		spin_unlock_bh(&bus->xfer_lock);
+		return 0;
+	}
+	list_add_tail(&xfer->node, &bus->xfer_queue);
+	trace_modbus_xfer_queue(xfer);
+	spin_unlock_bh(&bus->xfer_lock);
+	vMBPortEventKick(bus);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(modbus_submit);
+
+/**
+ * modbus_submit_batch - Queues several transactions back to back on a bus
+ * @bus: Bus of the slaves
+ * @xfers: Transactions, set up as for modbus_submit()
+ * @count: Number of entries in @xfers
+ *
+ * The transactions are queued in one go, in array order, so nothing else
+ * is sent in between and they only wait for the T3.5 silence of each
+ * other. They are never merged with identical queued reads.
+ *
+ * Must be called from process context. Once queued, every transaction is
+ * completed exactly once; one that can not be built is completed at once
+ * with ESEND_RQINVAL and the others are still sent.
+ *
+ * Return: 0 if queued, -ESHUTDOWN if the bus is stopped (nothing is queued nor completed)
+ */
+int modbus_submit_batch(struct modbus_bus *bus, struct modbus_xfer *xfers, unsigned int count)
+{
+	LIST_HEAD(invalid);
+	unsigned int i;
+
+	/* 1. Build every request, outside of the queue lock */
+	for (i = 0; i < count; i++)
 	{
-		/* Wake up when receiving messes from slave */
-		pr_info("usLength:%d\n",usLength);
-		err = modbusParseResponsePDU(&master,
-							  ucMBAddress,
-							  modbusMasterGetRequest(&master),
-							  modbusMasterGetRequestLength(&master),
-							  pucMBFrame,
-							  usLength);
-
-		if (!modbusIsOk(err))
+		if (xfer_prepare(bus, &xfers[i]))
 		{
-			pr_err("Error parsing request: %s(%s)\n",
-				modbusErrorSourceStr(modbusGetErrorSource(err)),
-				modbusErrorStr(modbusGetErrorCode(err)));
-			ret_val = ESEND_RPINVAL;	
+			INIT_LIST_HEAD(&xfers[i].followers);
+			init_completion(&xfers[i].done);
+			list_add_tail(&xfers[i].node, &invalid);
 		}
-		else
+	}
+
+	/* 2. Queue the valid ones contiguously */
+	spin_lock_bh(&bus->xfer_lock);
+	if (!bus->xfer_accept)
+	{
+		spin_unlock_bh(&bus->xfer_lock);
+		return -ESHUTDOWN;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if (list_empty(&xfers[i].node))
 		{
-			pr_info("Response parsing successfully\n");
-			ret_val = ESEND_NOERR;
+			list_add_tail(&xfers[i].node, &bus->xfer_queue);
+			trace_modbus_xfer_queue(&xfers[i]);
 		}
 	}
-out:
-	/* 7. Relase the master's lock */
-	master_state = EM_IDLE;
-	mutex_unlock(&master_lock);
-	return ret_val;
+	spin_unlock_bh(&bus->xfer_lock);
+	vMBPortEventKick(bus);
+
+	/* 3. Hand back the ones that could not be built */
+	while (!list_empty(&invalid))
+	{
+		struct modbus_xfer *xfer = list_first_entry(&invalid, struct modbus_xfer, node);
+
+		list_del_init(&xfer->node);
+		xfer_complete(bus, xfer, ESEND_RQINVAL);
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(modbus_submit_batch);
+
+/**
+ * modbus_xfer_wait - Waits for a transaction submitted without complete callback
+ * @xfer: Transaction passed to modbus_submit()
+ *
+ * The wait is not interruptible: @xfer may live on the caller stack and
+ * always completes, at the latest when its response timeout expires.
+ *
+ * Return: The transaction result
+ */
+SendRetType modbus_xfer_wait(struct modbus_xfer *xfer)
+{
+	wait_for_completion(&xfer->done);
+	trace_modbus_xfer_wake(xfer);
+	return xfer->status;
+}
+EXPORT_SYMBOL_GPL(modbus_xfer_wait);
+
+/**
+ * @brief Higher-level API to run one Modbus request and wait for its reply.
+ * @params
+ *	-values: Room for quantity values, filled for read requests (FC01 - FC04),
+ *			 or the quantity values to write for FC15/FC16 (may be NULL otherwise)
+ * FC23 needs two ranges, build a struct modbus_xfer and use modbus_submit().
+ */
+SendRetType ModbusSend(struct modbus_bus *bus, char Address, int function, int startAddress, int quantity,
+					   uint16_t *values, int timeout)
+{
+	struct modbus_xfer xfer = {
+		.address	= Address,
+		.function	= function,
+		.start		= startAddress,
+		.quantity	= quantity,
+		.timeout	= timeout,
+	};
+	int ret_val;
+
+	if (function == 15 || function == 16)
+		xfer.write_values = values;
+	else
+		xfer.values = values;
+	ret_val = modbus_submit(bus, &xfer);
+
+	if (ret_val == -EINVAL)
+		return ESEND_RQINVAL;
+	if (ret_val)
+		return ESEND_CANCELED;
+	mb_dbg("ModbusSend: waiting\n");
+	return modbus_xfer_wait(&xfer);
 }
 EXPORT_SYMBOL_GPL(ModbusSend);
 
-void ModbusReceive (unsigned char *buffer, uint16_t *length)
+/**
+ * modbus_rtt_get - Reads the response time estimate of a slave
+ * @bus: Bus of the slave
+ * @address: Slave address
+ * @timeout: Timeout configured for the slave in ms, upper bound of the estimate
+ * @est: Filled with the estimate
+ *
+ * The estimate is updated from the tasklet, the fields are read without lock.
+ */
+void modbus_rtt_get(struct modbus_bus *bus, uint8_t address, uint32_t timeout,
+					struct modbus_rtt_estimate *est)
 {
-	pr_info("Read %d registers from user\n",ubRspLength);
-	*length = ubRspLength * sizeof(*usRspone);
-	uiPortMemcpy(buffer,(char*)usRspone,*length);	
+	const struct modbus_slave *slave = &bus->slave[address];
+
+	est->srtt_us = READ_ONCE(slave->srtt_us);
+	est->rttvar_us = est->srtt_us ? READ_ONCE(slave->rttvar_us) : 0;
+	est->timeout_us = rtt_timeout(slave, timeout);
+}
+EXPORT_SYMBOL_GPL(modbus_rtt_get);
+
+/**
+ * modbus_health_get - Reads the circuit breaker state of a slave
+ * @bus: Bus of the slave
+ * @address: Slave address
+ * @health: Filled with the state
+ *
+ * The state is updated from the tasklet, the fields are read without lock.
+ * An open breaker is reported until the next transaction probes the slave.
+ */
+void modbus_health_get(struct modbus_bus *bus, uint8_t address, struct modbus_slave_health *health)
+{
+	const struct modbus_slave *slave = &bus->slave[address];
+
+	health->breaker = READ_ONCE(slave->breaker);
+	health->failures = READ_ONCE(slave->failures);
+	health->backoff = READ_ONCE(slave->backoff);
 }
-EXPORT_SYMBOL_GPL(ModbusReceive);
+EXPORT_SYMBOL_GPL(modbus_health_get);
@@ -20,12 +20,10 @@
  * SOFTWARE.
  */
 #include <linux/interrupt.h> /* Required for tasklets */
+#include <linux/kfifo.h>     /* Event ring */
+#include <linux/spinlock.h>
 #include "Include/mbport.h"
-
-/* Static variables */
-static eMBEventType eQueuedEvent;
-static BOOL xEventInQueue;
-struct tasklet_struct mb_tasklet;
+#include "../modbus_bus.h"
 
 /**
  * @brief The "Bottom Half" handler.
@@ -33,51 +31,76 @@ struct tasklet_struct mb_tasklet;
  */
 static void mb_event_tasklet_handler(struct tasklet_struct *t)
 {
+    struct modbus_bus *bus = from_tasklet(bus, t, event.xTasklet);
+
     /* Call the Modbus Poll to process the event queue */
-    ModbusRun();
+    ModbusRun(bus);
 }
 
-BOOL xMBPortEventInit(void)
+BOOL xMBPortEventInit(struct modbus_bus *bus)
 {
-    xEventInQueue = FALSE;
+    INIT_KFIFO(bus->event.xRing);
+    spin_lock_init(&bus->event.xLock);
     /* Initialize the tasklet */
-    tasklet_setup(&mb_tasklet, mb_event_tasklet_handler);
+    tasklet_setup(&bus->event.xTasklet, mb_event_tasklet_handler);
 	pr_info("Modbus Event: Init\n");
     return TRUE;
 }
 
-BOOL xMBPortEventPost(eMBEventType eEvent)
+BOOL xMBPortEventPost(struct modbus_bus *bus, eMBEventType eEvent)
 {
-    /* Critical Section: You might want to use a spinlock here if 
-       multiple IRQs can post at the same time */
-    xEventInQueue = TRUE;
-    eQueuedEvent = eEvent;
+    xMBPortEvent xEvent = {
+        .eType = eEvent,
+        .xTime = ktime_get(),
+    };
+
+    /* Producers may run in hard irq (hrtimer) or process context, irqsave lock */
+    if (!kfifo_in_spinlocked(&bus->event.xRing, &xEvent, 1, &bus->event.xLock))
+    {
+        pr_err_ratelimited("Modbus Event: Ring full, event %d dropped\n", eEvent);
+        return FALSE;
+    }
 
-    /* Schedule the tasklet to run (Soft IRQ trigger) */
-    tasklet_schedule(&mb_tasklet);
+    /* Schedule the tasklet to run (Soft IRQ trigger), no-op if already pending */
+    tasklet_schedule(&bus->event.xTasklet);
     
     return TRUE;
 }
 
-BOOL xMBPortEventGet(eMBEventType *eEvent)
+/**
+ * @brief Takes the oldest queued event, called by the tasklet until it returns FALSE.
+ * @params
+ *	-eEvent: Type of the event
+ *	-pxTime: Time the event was posted (may be NULL)
+ */
+BOOL xMBPortEventGet(struct modbus_bus *bus, eMBEventType *eEvent, ktime_t *pxTime)
 {
-    BOOL xEventHappened = FALSE;
+    xMBPortEvent xEvent;
 
-    if(xEventInQueue)
-    {
-        *eEvent = eQueuedEvent;
-        xEventInQueue = FALSE;
-        xEventHappened = TRUE;
-    }
+    /* Single consumer, kfifo needs no lock on this side */
+    if (!kfifo_out(&bus->event.xRing, &xEvent, 1))
+        return FALSE;
+
+    *eEvent = xEvent.eType;
+    if (pxTime)
+        *pxTime = xEvent.xTime;
+    return TRUE;
+}
 
-    return xEventHappened;
+/**
+ * @brief Runs the poll without posting an event, so a pending event is not overwritten.
+ * Used when the master has new work queued (transaction submitted, response timeout).
+ */
+void vMBPortEventKick(struct modbus_bus *bus)
+{
+    tasklet_schedule(&bus->event.xTasklet);
 }
 
 /**
  * @brief Remember to clean up in your driver's exit function!
  */
-void vMBPortEventDeinit(void)
+void vMBPortEventDeinit(struct modbus_bus *bus)
 {
-    tasklet_kill(&mb_tasklet);
+    tasklet_kill(&bus->event.xTasklet);
 	pr_info("Modbus Event: Destroy\n");
 }
@@ -30,25 +30,24 @@
 #include "Include/port.h"
 #include "Include/mbport.h"
 #include "Include/mbrtu.h"
+#include "../modbus_bus.h"
 
-BOOL xMBPortTimersInit( USHORT usTim1Timerout50us )
+BOOL xMBPortTimersInit( struct modbus_bus * bus, USHORT usTim1Timerout50us )
 {
-	timer_init((int)usTim1Timerout50us); 
+	timer_init(bus, (int)usTim1Timerout50us); 
 	/**
 	 * Registe T32 expried with modbus timer 
 	 */
-	timer_register_callback(&xMBRTUTimerT35Expired);
+	timer_register_callback(bus, &xMBRTUTimerT35Expired);
 	return true;
 }
 
-void vMBPortTimersStart( void )
+void vMBPortTimersStart( struct modbus_bus * bus )
 {
-	timer_start();
+	timer_start(bus);
 }
 
-void vMBPortTimersCancel( void )
+void vMBPortTimersCancel( struct modbus_bus * bus )
 {
-	timer_cancel();
+	timer_cancel(bus);
 }
-
-
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2026 Văn Tiến <tien11102004@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/*
+ * Host-side check of the RTU CRC (mbcrc.c) against a bitwise CRC-16/MODBUS
+ * reference, then a small bench of the byte-wise and slice-by-4 paths.
+ *
+ *	make crc-check
+ *
+ * Exits non-zero on the first mismatch.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ----------------------- Port shim ----------------------------------------*/
+/* mbcrc.c only needs the FreeModbus types, keep the kernel port.h out */
+#define PORT_H_
+typedef bool            BOOL;
+typedef unsigned char   UCHAR;
+typedef uint16_t        USHORT;
+#define TRUE            true
+#define FALSE           false
+
+#include "../mbcrc.c"
+
+#define CHECK_FRAMES        20000   /* Random frames per pass */
+#define CHECK_MAX_LEN       256     /* MB_SER_PDU_SIZE_MAX */
+#define BENCH_ROUNDS        200000
+
+/* CRC-16/MODBUS, one bit at a time: poly 0xA001 (reflected 0x8005), init 0xFFFF */
+static USHORT crc16_reference(USHORT crc, const UCHAR *buf, size_t len)
+{
+	while (len--)
+	{
+		crc ^= *buf++;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return crc;
+}
+
+/* Same frame fed in random chunks, as the receive FSM does */
+static USHORT crc16_chunked(const UCHAR *buf, USHORT len)
+{
+	USHORT crc = MB_CRC16_INIT;
+
+	while (len)
+	{
+		USHORT chunk = 1 + rand() % len;
+
+		crc = usMBCRC16Update(crc, buf, chunk);
+		buf += chunk;
+		len -= chunk;
+	}
+	return crc;
+}
+
+/**
+ * @brief Checks one frame, whole, chunked and with its CRC appended.
+ * @return 0, or -1 on a mismatch
+ */
+static int check_frame(UCHAR *buf, USHORT len, const char *pass)
+{
+	USHORT ref = crc16_reference(MB_CRC16_INIT, buf, len);
+	USHORT crc = usMBCRC16(buf, len);
+	USHORT chunked = crc16_chunked(buf, len);
+
+	if (crc != ref || chunked != ref)
+	{
+		fprintf(stderr, "%s: length %u: reference 0x%04x, usMBCRC16 0x%04x, chunked 0x%04x\n",
+				pass, len, ref, crc, chunked);
+		return -1;
+	}
+	/* CRC low byte first, a valid frame ends on 0 */
+	if (len + 2 <= CHECK_MAX_LEN)
+	{
+		buf[len] = crc & 0xFF;
+		buf[len + 1] = crc >> 8;
+		if (usMBCRC16Update(MB_CRC16_INIT, buf, len + 2) != 0)
+		{
+			fprintf(stderr, "%s: length %u: framed CRC does not end on 0\n", pass, len);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int check_pass(const char *pass)
+{
+	UCHAR buf[CHECK_MAX_LEN];
+
+	/* 1. Every length, random content */
+	for (USHORT len = 0; len <= CHECK_MAX_LEN; len++)
+	{
+		for (USHORT i = 0; i < len; i++)
+			buf[i] = rand();
+		if (check_frame(buf, len, pass))
+			return -1;
+	}
+	/* 2. Random frames */
+	for (int n = 0; n < CHECK_FRAMES; n++)
+	{
+		USHORT len = rand() % (CHECK_MAX_LEN + 1);
+
+		for (USHORT i = 0; i < len; i++)
+			buf[i] = rand();
+		if (check_frame(buf, len, pass))
+			return -1;
+	}
+	/* 3. Known vector, CRC-16/MODBUS of "123456789" */
+	memcpy(buf, "123456789", 9);
+	if (usMBCRC16(buf, 9) != 0x4B37)
+	{
+		fprintf(stderr, "%s: check value 0x%04x, expected 0x4b37\n", pass, usMBCRC16(buf, 9));
+		return -1;
+	}
+	printf("%s: ok\n", pass);
+	return 0;
+}
+
+static double bench(USHORT (*fn)(USHORT, const UCHAR *, USHORT), const UCHAR *buf, USHORT len)
+{
+	struct timespec t0, t1;
+	volatile USHORT sink = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int n = 0; n < BENCH_ROUNDS; n++)
+		sink ^= fn(MB_CRC16_INIT, buf, len);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	(void)sink;
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ((double)BENCH_ROUNDS * len);
+}
+
+int main(void)
+{
+	UCHAR buf[CHECK_MAX_LEN];
+	static const USHORT lens[] = { 8, 16, 64, 256 };
+
+	srand(1);
+	/* 1. Before vMBCRC16Init(), byte-wise tables only */
+	if (check_pass("byte-wise"))
+		return 1;
+	/* 2. With the slice-by-4 tables */
+	vMBCRC16Init();
+	if (check_pass("slice-by-4"))
+		return 1;
+
+	/* 3. Bench, ns per byte */
+	for (USHORT i = 0; i < CHECK_MAX_LEN; i++)
+		buf[i] = rand();
+	for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+		printf("%3u bytes: byte-wise %.2f ns/byte, usMBCRC16Update %.2f ns/byte\n", lens[i],
+			   bench(usMBCRC16Bytewise, buf, lens[i]), bench(usMBCRC16Update, buf, lens[i]));
+	return 0;
+}
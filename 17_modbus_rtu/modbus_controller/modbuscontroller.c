@@ -21,25 +21,22 @@
  */
 #include <linux/property.h>
 #include <linux/platform_device.h>
-#include "modbus_controller.h"
+#include "modbus_bus.h"
+#include "modbus_rtu/Include/mbcrc.h"
 
-#define MAX_LENGTH_BUFF 256
-#define BAUDRATE		9600	
-/* Use for register callback */
-bool (*transmit_success_ptr)(void) = NULL;
-bool (*receive_callback_ptr)(void) = NULL;
+#define CREATE_TRACE_POINTS
+#include "trace/events/modbus.h"
+
+#define BAUDRATE		9600	/* Default line speed, override with 'lsmy,baudrate' */
 
 static size_t modbus_controller_recv(struct serdev_device *serdev, const unsigned char *buffer, size_t size);
+static void modbus_controller_write_wakeup(struct serdev_device *serdev);
 //static void modbus_controller_snd_success(struct serdev_device *serdev);
-struct serdev_device *modbus_controller;
 
 /* Declate the probe and remove functions */
 static int modbus_controller_probe(struct serdev_device *serdev);
 static void modbus_controller_remove(struct serdev_device *serdev);
 
-uint8_t length = 0;
-char receive_buff[MAX_LENGTH_BUFF];
-
 struct of_device_id modbus_controller_ids[] = {
 	{
 		.compatible = "serdev,modbus_controller",
@@ -59,18 +56,29 @@ struct serdev_device_driver modbus_controller_driver = {
 struct serdev_device_ops modbus_controller_ops = 
 {
 	.receive_buf = modbus_controller_recv,
+	.write_wakeup = modbus_controller_write_wakeup,
 	//.write_wakeup = modbus_controller_snd_success,
 };
 /**
  * @brief This function is called on loading the driver 
+ * Every probed UART gets its own bus, with its own stack and poller.
  */
 static int modbus_controller_probe(struct serdev_device *serdev) {
     int status;
+	struct modbus_bus *bus;
     
     pr_info("Modbus controller - Starting probe process\n");
 
-    /* 1. Initialize global pointer immediately for other functions to reference */
-    modbus_controller = serdev;
+    /* 1. Allocate the bus context, children find it through drvdata */
+	bus = devm_kzalloc(&serdev->dev, sizeof(*bus), GFP_KERNEL);
+	if (!bus)
+		return -ENOMEM;
+	bus->serdev = serdev;
+	if (device_property_read_u32(&serdev->dev, "lsmy,baudrate", &bus->baudrate))
+		bus->baudrate = BAUDRATE;
+	/* Opt-in: complete replies on their expected length, T3.5 stays the fallback */
+	bus->early_frame_end = device_property_read_bool(&serdev->dev, "lsmy,early-frame-end");
+	serdev_device_set_drvdata(serdev, bus);
 
     /* 2. Open the device first to initialize internal TTY structures */
     status = serdev_device_open(serdev);
@@ -80,31 +88,48 @@ static int modbus_controller_probe(struct serdev_device *serdev) {
     }
 
     /* 3. Configure Serial parameters (Safe only after opening) */
-    serdev_device_set_baudrate(serdev, BAUDRATE);
+    serdev_device_set_baudrate(serdev, bus->baudrate);
     serdev_device_set_parity(serdev, SERDEV_PARITY_NONE);
     serdev_device_set_flow_control(serdev, false);
 
 	serdev_device_set_client_ops(serdev,&modbus_controller_ops);
-	(void)ModbusInit(BAUDRATE);
-	pr_info("Modbus Controller: Register uart with baudrate: %d\n",BAUDRATE);
+	if (!ModbusInit(bus, bus->baudrate)) {
+		pr_err("Modbus controller - Failed to init Modbus master\n");
+		status = -ENOMEM;
+		goto err_close_serdev;
+	}
+	dev_info(&serdev->dev, "Modbus Controller: Register uart with baudrate: %u\n", bus->baudrate);
     /* 4. Start Modbus Layer (Initializes Timers and Tasklets) */
-    if(!ModbusStart()) {
+    if(!ModbusStart(bus)) {
         pr_err("Modbus controller - Failed to start Modbus link layer\n");
         status = -EINVAL;
         goto err_close_serdev; /* Jump to cleanup label */
     }
 
+    /* 5. Start the background poller, child devices register to it */
+	status = modbus_poller_start(bus);
+	if (status) {
+		pr_err("Modbus controller - Failed to start poller: %d\n", status);
+		goto err_destroy_modbus;
+	}
+
     /* 7. Populate child nodes (sensors) defined in Device Tree */
 	status = devm_of_platform_populate(&serdev->dev);
 	if (status) {
 		pr_err("Modbus controller - Failed to populate child devices: %d\n", status);
-		goto err_close_serdev;
+		goto err_stop_poller;
 	}
     pr_info("Modbus controller - Probe successful!\n");
     return 0;
 
 /* --- Error Handling Labels --- */
 
+err_stop_poller:
+	modbus_poller_stop(bus);
+err_destroy_modbus:
+	serdev_device_close(serdev);
+	ModbusDestroy(bus);
+	return status;
 err_close_serdev:
     /* If ModbusStart fails, we must close the port opened in step 2 */
     serdev_device_close(serdev);
@@ -115,39 +140,48 @@ err_close_serdev:
  * @brief This function is called on unloading the driver 
  */
 static void modbus_controller_remove(struct serdev_device *serdev) {
+	struct modbus_bus *bus = serdev_device_get_drvdata(serdev);
+
 	pr_info("Modbus controller - Now I am in the remove function\n");
-	ModbusDestroy();
+	modbus_poller_stop(bus);
+	/* Close first, no receive callback may restart the stack being destroyed */
 	serdev_device_close(serdev);
+	ModbusDestroy(bus);
 }
 
 /* 
  * Run finite state machine when interupt occur 
+ * The FSM copies the bytes straight into its frame buffer, nothing is staged here.
  * */
 static size_t modbus_controller_recv(struct serdev_device *serdev, const unsigned char *buffer, size_t size)
 {
-	for (int i = 0; i < (int) size; i++)
-	{
-		if (length < MAX_LENGTH_BUFF) 
-		{
-			receive_buff[length++] = buffer[i];
-		} 
-		else 
-		{
-			break;
-		}
-	}
-	if (receive_callback_ptr)
+	struct modbus_bus *bus = serdev_device_get_drvdata(serdev);
+
+	if (bus->receive_callback)
 	{
-		(void)receive_callback_ptr();
+		(void)bus->receive_callback(bus, buffer, min_t(size_t, size, U16_MAX));
 	}
 	return size;
 }
 
+/*
+ * The tty buffer is drained into the UART, only the FIFO is left to send.
+ * Traced only, the RTU layer does not wait for the end of transmission.
+ * */
+static void modbus_controller_write_wakeup(struct serdev_device *serdev)
+{
+	struct modbus_bus *bus = serdev_device_get_drvdata(serdev);
+
+	if (bus)
+		trace_modbus_tx_done(bus, bus->rtu.ucSndAddress, bus->rtu.ucSndFunction, bus->rtu.usSndLength);
+}
+
 //static void modbus_controller_snd_success(struct serdev_device *serdev)
 //{
-//	if(transmit_success_ptr)
+//	struct modbus_bus *bus = serdev_device_get_drvdata(serdev);
+//	if(bus->transmit_success)
 //	{
-//		(void)transmit_success_ptr();
+//		(void)bus->transmit_success(bus);
 //	}	
 //}
 
@@ -155,30 +189,39 @@ static size_t modbus_controller_recv(struct serdev_device *serdev, const unsigne
 	Exported functions
 ***********************************************************/
 
-/* 
- * Write, read  
- * */
-void modbus_controller_write(char* buffer, int length)
+/**
+ * modbus_bus_from_device - Returns the bus of a controller node
+ * @parent: Parent device of a Modbus child device (the controller serdev)
+ *
+ * Return: The bus, or NULL if @parent is not a bound Modbus controller
+ */
+struct modbus_bus *modbus_bus_from_device(struct device *parent)
 {
-	serdev_device_write_buf(modbus_controller,buffer,length);
+	if (!parent || parent->driver != &modbus_controller_driver.driver)
+		return NULL;
+	return serdev_device_get_drvdata(to_serdev_device(parent));
 }
+EXPORT_SYMBOL_GPL(modbus_bus_from_device);
 
-void modbus_controller_read(char *buffer, int *count)
+/* 
+ * Write, read  
+ * */
+void modbus_controller_write(struct modbus_bus *bus, char* buffer, int length)
 {
-	*count = length;
-	memcpy(buffer,receive_buff,length);
-	length = 0;
+	serdev_device_write_buf(bus->serdev,buffer,length);
 }
 
 /**
  * register_modbus_callbacks - Assigns the FSM functions
+ * @bus: Bus the callbacks are run for
  * @tx_func: Pointer to the Transmit FSM function
  * @rx_func: Pointer to the Receive FSM function
  */
-void register_modbus_callbacks(bool (*tx_func)(void), bool (*rx_func)(void))
+void register_modbus_callbacks(struct modbus_bus *bus, bool (*tx_func)(struct modbus_bus *bus),
+							   bool (*rx_func)(struct modbus_bus *bus, const unsigned char *data, uint16_t count))
 {
-    transmit_success_ptr = tx_func;
-    receive_callback_ptr = rx_func;
+    bus->transmit_success = tx_func;
+    bus->receive_callback = rx_func;
 }
 
 /* -------------------------------------------------------------------------
@@ -188,6 +231,8 @@ void register_modbus_callbacks(bool (*tx_func)(void), bool (*rx_func)(void))
 static int __init modbus_controller_init (void)
 {
 	int ret_val;
+	/* CRC tables are shared by all buses, build them before any probe */
+	vMBCRC16Init();
 	ret_val = serdev_device_driver_register(&modbus_controller_driver);
 	if(ret_val)
 	{
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2026 Văn Tiến <tien11102004@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include "modbus_bus.h"
+
+#define POLL_MIN_INTERVAL	10		/* ms, keeps a zero interval from saturating the bus */
+
+/**
+ * @brief Poller thread of one bus, samples every client at its own rate.
+ * The client with the earliest deadline is always served first, so devices
+ * with different sampling intervals share the bus without starving each other.
+ */
+static int modbus_poller_thread(void *arg)
+{
+	struct modbus_bus *bus = arg;
+
+	while (!kthread_should_stop())
+	{
+		struct modbus_poll_client *client, *next = NULL;
+		ktime_t now;
+
+		mutex_lock(&bus->poll_lock);
+		/* 1. Pick the earliest deadline */
+		list_for_each_entry(client, &bus->poll_clients, node)
+		{
+			if (!next || ktime_before(client->deadline, next->deadline))
+				next = client;
+		}
+
+		/* 2. Due, run it without the lock and compute the next release time */
+		now = ktime_get();
+		if (next && !ktime_after(next->deadline, now))
+		{
+			ktime_t due = next->deadline;
+			uint32_t interval;
+
+			/* modbus_poller_remove() waits for it, @next stays valid */
+			WRITE_ONCE(bus->poll_running, next);
+			mutex_unlock(&bus->poll_lock);
+			interval = max_t(uint32_t, next->poll(next), POLL_MIN_INTERVAL);
+
+			mutex_lock(&bus->poll_lock);
+			/* Kicked during the poll, the new deadline wins */
+			if (next->deadline == due)
+			{
+				next->deadline = ktime_add_ms(due, interval);
+				/* Overran a whole period (slow bus), do not try to catch up */
+				if (ktime_before(next->deadline, now))
+					next->deadline = ktime_add_ms(now, interval);
+			}
+			/* Last access to @next, modbus_poller_remove() may return from here on */
+			WRITE_ONCE(bus->poll_running, NULL);
+			mutex_unlock(&bus->poll_lock);
+			wake_up(&bus->poll_wq);
+			cond_resched();
+			continue;
+		}
+
+		/* 3. Nothing due, sleep until the next deadline or a change */
+		bus->poll_changed = false;
+		mutex_unlock(&bus->poll_lock);
+		if (next)
+			wait_event_interruptible_hrtimeout(bus->poll_wq,
+					READ_ONCE(bus->poll_changed) || kthread_should_stop(),
+					ktime_sub(next->deadline, now));
+		else
+			wait_event_interruptible(bus->poll_wq,
+					READ_ONCE(bus->poll_changed) || kthread_should_stop());
+	}
+	return 0;
+}
+
+static void modbus_poller_notify(struct modbus_bus *bus)
+{
+	WRITE_ONCE(bus->poll_changed, true);
+	wake_up_interruptible(&bus->poll_wq);
+}
+
+/*****************************************************************
+ *	Exported function
+*****************************************************************/
+/**
+ * @brief Starts the poller thread of a bus, called from the controller probe.
+ */
+int modbus_poller_start(struct modbus_bus *bus)
+{
+	INIT_LIST_HEAD(&bus->poll_clients);
+	mutex_init(&bus->poll_lock);
+	init_waitqueue_head(&bus->poll_wq);
+	bus->poll_running = NULL;
+	bus->poll_task = kthread_run(modbus_poller_thread, bus, "modbus_poller/%s",
+								 dev_name(&bus->serdev->dev));
+	if (IS_ERR(bus->poll_task))
+	{
+		int ret_val = PTR_ERR(bus->poll_task);
+		bus->poll_task = NULL;
+		return ret_val;
+	}
+	pr_info("Modbus poller: Started\n");
+	return 0;
+}
+
+/**
+ * @brief Stops the poller thread of a bus, waits for the running poll to finish.
+ */
+void modbus_poller_stop(struct modbus_bus *bus)
+{
+	if (bus->poll_task)
+	{
+		kthread_stop(bus->poll_task);
+		bus->poll_task = NULL;
+	}
+	pr_info("Modbus poller: Stopped\n");
+}
+
+/**
+ * modbus_poller_add - Registers a device to be sampled in background
+ * @bus: Bus of the device
+ * @client: Poll client embedded in the device private data
+ *
+ * The first sample is taken as soon as possible.
+ */
+void modbus_poller_add(struct modbus_bus *bus, struct modbus_poll_client *client)
+{
+	mutex_lock(&bus->poll_lock);
+	client->deadline = ktime_get();
+	list_add_tail(&client->node, &bus->poll_clients);
+	mutex_unlock(&bus->poll_lock);
+	modbus_poller_notify(bus);
+}
+EXPORT_SYMBOL_GPL(modbus_poller_add);
+
+/**
+ * modbus_poller_remove - Unregisters a device
+ * @bus: Bus of the device
+ * @client: Poll client passed to modbus_poller_add()
+ *
+ * When this returns the poll callback of @client is not running and will
+ * not be called again.
+ */
+void modbus_poller_remove(struct modbus_bus *bus, struct modbus_poll_client *client)
+{
+	mutex_lock(&bus->poll_lock);
+	list_del(&client->node);
+	mutex_unlock(&bus->poll_lock);
+	/* Off the list, the poller can not pick it again, wait for a running poll */
+	wait_event(bus->poll_wq, READ_ONCE(bus->poll_running) != client);
+	modbus_poller_notify(bus);
+}
+EXPORT_SYMBOL_GPL(modbus_poller_remove);
+
+/**
+ * modbus_poller_kick - Samples a device now and restarts its period
+ * @bus: Bus of the device
+ * @client: Poll client passed to modbus_poller_add()
+ *
+ * Used when the sampling interval of a device has been changed. Never
+ * waits for a running poll; a client kicked while it is polled runs again
+ * right after.
+ */
+void modbus_poller_kick(struct modbus_bus *bus, struct modbus_poll_client *client)
+{
+	mutex_lock(&bus->poll_lock);
+	client->deadline = ktime_get();
+	mutex_unlock(&bus->poll_lock);
+	modbus_poller_notify(bus);
+}
+EXPORT_SYMBOL_GPL(modbus_poller_kick);
@@ -22,16 +22,7 @@
 #include <linux/hrtimer.h>
 #include <linux/ktime.h>
 #include <linux/kernel.h>
-#include "modbus_controller.h"
-/* --- Global-Static Variables --- */
-/* High-resolution timer structure managed by the kernel */
-static struct hrtimer my_hrtimer;
-
-/* Stores the programmed interval in kernel time format for reuse in timer_enable */
-static ktime_t active_interval; 
-
-/* The timer callback function pointer */
-bool (*hrtimer_expired)(void);
+#include "modbus_bus.h"
 
 /**
  * @brief Timer callback handler triggered upon expiration.
@@ -39,11 +30,12 @@ bool (*hrtimer_expired)(void);
  * @return HRTIMER_NORESTART to indicate the timer shouldn't auto-repeat.
  */
 static enum hrtimer_restart test_hrtimer_handler(struct hrtimer *timer) {
+	struct modbus_bus *bus = container_of(timer, struct modbus_bus, t35_timer);
     /* * Modbus RTU Logic: This signifies a T35 (3.5 char) silence has occurred.
      */
-	if (hrtimer_expired)
-		(void)hrtimer_expired();
-	pr_info("Timer is expired\n");
+	if (bus->t35_expired)
+		(void)bus->t35_expired(bus);
+	mb_dbg("Timer is expired\n");
     return HRTIMER_NORESTART;
 }
 
@@ -52,9 +44,10 @@ static enum hrtimer_restart test_hrtimer_handler(struct hrtimer *timer) {
 *****************************************************************/
 /**
  * @brief Configures and prepares the timer hardware.
+ * @param bus: Bus owning the timer
  * @param usTimTimerout50us: Multiplier for the 50us base unit.
  */
-void timer_init(int usTimTimerout50us) 
+void timer_init(struct modbus_bus *bus, int usTimTimerout50us) 
 {
 	pr_info("Modbustimer init: %d * 50(us)\n",usTimTimerout50us);
     unsigned long timeout_us;
@@ -62,13 +55,13 @@ void timer_init(int usTimTimerout50us)
     timeout_us = (unsigned long)usTimTimerout50us * 50;
 
     /* Initialize the timer structure with a monotonic clock (ignores wall-clock jumps) */
-    hrtimer_init(&my_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    hrtimer_init(&bus->t35_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 
     /* Link the handler function to the timer object */
-    my_hrtimer.function = &test_hrtimer_handler;
+    bus->t35_timer.function = &test_hrtimer_handler;
 
     /* Convert calculated micro-seconds into the specialized ktime_t format */
-    active_interval = ktime_set(0, timeout_us * 1000);
+    bus->t35_interval = ktime_set(0, timeout_us * 1000);
 
     printk(KERN_INFO "Modbus Timer: Initialized with %lu us interval.\n", timeout_us);
 
@@ -78,34 +71,34 @@ void timer_init(int usTimTimerout50us)
  * @brief Stops the timer and ensures the handler has finished execution.
  * Use this when the driver is closing or entering a low-power state.
  */
-void timer_cancel(void)
+void timer_cancel(struct modbus_bus *bus)
 {
     /* hrtimer_cancel is synchronous: it waits for any running handler to finish */
-    hrtimer_cancel(&my_hrtimer);
+    hrtimer_cancel(&bus->t35_timer);
 }
 
-void timer_register_callback(bool (*hrtimer_expired_callback)(void)) 
+void timer_register_callback(struct modbus_bus *bus, bool (*hrtimer_expired_callback)(struct modbus_bus *bus)) 
 {
-	hrtimer_expired = hrtimer_expired_callback;
+	bus->t35_expired = hrtimer_expired_callback;
 }
 /**
  * @brief Starts or Resets the timer countdown.
  * In Modbus RTU, call this every time a byte is received to reset the silence clock.
  */
-void timer_start(void)
+void timer_start(struct modbus_bus *bus)
 {
     /* * Starts the timer relative to the current moment.
      * If the timer was already running, it is automatically rescheduled.
      */
-    hrtimer_start(&my_hrtimer, active_interval, HRTIMER_MODE_REL);
+    hrtimer_start(&bus->t35_timer, bus->t35_interval, HRTIMER_MODE_REL);
 }
 
 /**
  * @brief Cleanup function to be called during module_exit.
  */
-void timer_remove(void) 
+void timer_remove(struct modbus_bus *bus) 
 {
     /* Ensure the timer is stopped and cannot trigger again */
-    hrtimer_cancel(&my_hrtimer);
+    hrtimer_cancel(&bus->t35_timer);
     printk(KERN_INFO "Modbus Timer: Cleaned up and removed.\n");
 }
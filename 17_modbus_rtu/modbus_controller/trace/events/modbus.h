@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2026 Văn Tiến <tien11102004@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/*
+ * Tracepoints of the Modbus transaction path, one per phase:
+ *
+ *	modbus_xfer_queue		modbus_submit(), request on the bus queue
+ *	modbus_xfer_start		tasklet, the bus is free and takes the request
+ *	modbus_rtu_send			eMBRTUSend(), frame handed to serdev
+ *	modbus_tx_done			serdev write_wakeup, the tty buffer is drained
+ *	modbus_rx_start			first byte of a reply from the UART
+ *	modbus_t35_expired		T3.5 silence, end of the received frame
+ *	modbus_frame_received	tasklet, EV_FRAME_RECEIVED processing
+ *	modbus_xfer_done		result handed to the owner
+ *	modbus_xfer_wake		waiter of modbus_xfer_wait() runs again
+ *
+ * Every event carries slave, function and length, plus the transaction for
+ * the transaction events and the bus for the link layer ones, so the phases
+ * can be matched and measured with hist triggers, e.g.
+ *	echo 'hist:keys=slave,function:vals=hitcount' > \
+ *		/sys/kernel/tracing/events/modbus/modbus_frame_received/trigger
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM modbus
+
+#if !defined(_TRACE_MODBUS_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_MODBUS_H
+
+#include <linux/tracepoint.h>
+#include "modbus_controller.h"
+
+/* -------------------------------------------------------------------------
+ * Transaction events
+ * ------------------------------------------------------------------------- */
+DECLARE_EVENT_CLASS(modbus_xfer_class,
+
+	TP_PROTO(const struct modbus_xfer *xfer),
+
+	TP_ARGS(xfer),
+
+	TP_STRUCT__entry(
+		__field(const void *,	xfer)
+		__field(u8,				slave)
+		__field(u8,				function)
+		__field(u16,			length)
+	),
+
+	TP_fast_assign(
+		__entry->xfer = xfer;
+		__entry->slave = xfer->address;
+		__entry->function = xfer->function;
+		__entry->length = xfer->adu_len;
+	),
+
+	TP_printk("xfer=%p slave=%u function=%u length=%u",
+		  __entry->xfer, __entry->slave, __entry->function,
+		  __entry->length)
+);
+
+DEFINE_EVENT(modbus_xfer_class, modbus_xfer_queue,
+	TP_PROTO(const struct modbus_xfer *xfer),
+	TP_ARGS(xfer)
+);
+
+DEFINE_EVENT(modbus_xfer_class, modbus_xfer_start,
+	TP_PROTO(const struct modbus_xfer *xfer),
+	TP_ARGS(xfer)
+);
+
+DEFINE_EVENT(modbus_xfer_class, modbus_xfer_wake,
+	TP_PROTO(const struct modbus_xfer *xfer),
+	TP_ARGS(xfer)
+);
+
+/* Length is the number of values returned */
+TRACE_EVENT(modbus_xfer_done,
+
+	TP_PROTO(const struct modbus_xfer *xfer, int status),
+
+	TP_ARGS(xfer, status),
+
+	TP_STRUCT__entry(
+		__field(const void *,	xfer)
+		__field(u8,				slave)
+		__field(u8,				function)
+		__field(u16,			length)
+		__field(int,			status)
+	),
+
+	TP_fast_assign(
+		__entry->xfer = xfer;
+		__entry->slave = xfer->address;
+		__entry->function = xfer->function;
+		__entry->length = xfer->count;
+		__entry->status = status;
+	),
+
+	TP_printk("xfer=%p slave=%u function=%u length=%u status=%d",
+		  __entry->xfer, __entry->slave, __entry->function,
+		  __entry->length, __entry->status)
+);
+
+/* -------------------------------------------------------------------------
+ * Link layer events
+ * ------------------------------------------------------------------------- */
+DECLARE_EVENT_CLASS(modbus_frame_class,
+
+	TP_PROTO(const void *bus, u8 slave, u8 function, u16 length),
+
+	TP_ARGS(bus, slave, function, length),
+
+	TP_STRUCT__entry(
+		__field(const void *,	bus)
+		__field(u8,				slave)
+		__field(u8,				function)
+		__field(u16,			length)
+	),
+
+	TP_fast_assign(
+		__entry->bus = bus;
+		__entry->slave = slave;
+		__entry->function = function;
+		__entry->length = length;
+	),
+
+	TP_printk("bus=%p slave=%u function=%u length=%u",
+		  __entry->bus, __entry->slave, __entry->function,
+		  __entry->length)
+);
+
+DEFINE_EVENT(modbus_frame_class, modbus_rtu_send,
+	TP_PROTO(const void *bus, u8 slave, u8 function, u16 length),
+	TP_ARGS(bus, slave, function, length)
+);
+
+DEFINE_EVENT(modbus_frame_class, modbus_tx_done,
+	TP_PROTO(const void *bus, u8 slave, u8 function, u16 length),
+	TP_ARGS(bus, slave, function, length)
+);
+
+/* Length is the size of the first chunk, the function is 0 if it was one byte */
+DEFINE_EVENT(modbus_frame_class, modbus_rx_start,
+	TP_PROTO(const void *bus, u8 slave, u8 function, u16 length),
+	TP_ARGS(bus, slave, function, length)
+);
+
+DEFINE_EVENT(modbus_frame_class, modbus_t35_expired,
+	TP_PROTO(const void *bus, u8 slave, u8 function, u16 length),
+	TP_ARGS(bus, slave, function, length)
+);
+
+/* Length is the PDU length, delay the time the frame waited for the tasklet */
+TRACE_EVENT(modbus_frame_received,
+
+	TP_PROTO(const void *bus, u8 slave, u8 function, u16 length, s64 delay_us),
+
+	TP_ARGS(bus, slave, function, length, delay_us),
+
+	TP_STRUCT__entry(
+		__field(const void *,	bus)
+		__field(u8,				slave)
+		__field(u8,				function)
+		__field(u16,			length)
+		__field(s64,			delay_us)
+	),
+
+	TP_fast_assign(
+		__entry->bus = bus;
+		__entry->slave = slave;
+		__entry->function = function;
+		__entry->length = length;
+		__entry->delay_us = delay_us;
+	),
+
+	TP_printk("bus=%p slave=%u function=%u length=%u delay_us=%lld",
+		  __entry->bus, __entry->slave, __entry->function,
+		  __entry->length, __entry->delay_us)
+);
+
+#endif /* _TRACE_MODBUS_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH trace/events
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE modbus
+#include <trace/define_trace.h>
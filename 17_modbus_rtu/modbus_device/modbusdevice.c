@@ -79,9 +79,16 @@ static void modbusplatform_driver_remove(struct platform_device *pdev);
 /* Same for all sensors */
 static DEVICE_ATTR(interval_time, S_IRUGO | S_IWUSR, interval_show, interval_store);
 static DEVICE_ATTR(timeout, S_IRUGO | S_IWUSR, timeout_show, timeout_store);
+static DEVICE_ATTR(rtt_estimate, S_IRUGO, rtt_estimate_show, NULL);
+static DEVICE_ATTR(health, S_IRUGO, health_show, NULL);
+static DEVICE_ATTR(stats, S_IRUGO, stats_show, NULL);
+static DEVICE_ATTR(stats_window, S_IRUGO | S_IWUSR, stats_window_show, stats_window_store);
 static DEVICE_ATTR(slave_address, S_IRUGO, slave_address_show,NULL);
+static DEVICE_ATTR(reg_write, S_IWUSR, NULL, reg_write_store);
+static DEVICE_ATTR(commit, S_IWUSR, NULL, commit_store);
+static DEVICE_ATTR(write_delay, S_IRUGO | S_IWUSR, write_delay_show, write_delay_store);
 /* They vary depending on the type of sensor */
-static DEVICE_ATTR(co_value, S_IRUGO, slave_address_show,NULL);
+static DEVICE_ATTR(co_value, S_IRUGO, co_show,NULL);
 static DEVICE_ATTR(pm2_5_value, S_IRUGO, pm2_5_show,NULL);
 static DEVICE_ATTR(pm1_0_value, S_IRUGO, pm1_0_show,NULL);
 #ifdef CONFIG_PM10
@@ -93,7 +100,12 @@ struct file_operations modbusfops =
 	.read    = modbus_read,
 	.write   = modbus_write,
 	.llseek  = modbus_llseek,
+	.poll    = modbus_poll,
+	.mmap    = modbus_mmap,
+	.unlocked_ioctl = modbus_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
 	.release = modbus_release,
+	.fsync   = modbus_fsync,
 	.owner   = THIS_MODULE,
 };
 
@@ -140,6 +152,15 @@ static struct modev_platform_data *modev_get_platdata_from_dt(mbdev_t device_typ
 		return ERR_PTR(ret_val);
 	}
 
+	/* 2.5. Get read function code (optional 'lsmy,function'), holding registers by default */
+	pdata->function = 3;
+	of_property_read_u32(dev_node, "lsmy,function", &pdata->function);
+	if (pdata->function != 3 && pdata->function != 4)
+	{
+		dev_err(dev, "Unsupported lsmy,function %u, only 3 or 4\n", pdata->function);
+		return ERR_PTR(-EINVAL);
+	}
+
 	count = of_property_count_u32_elems(dev_node, "lsmy,reg-addresses");
 	/* 3. Process Register Addresses */
 	switch(device_type)
@@ -201,6 +222,12 @@ struct platform_driver modbusplatform_driver = {
 	},
 };
 
+/* Releases the shared snapshot page, user mappings keep their own reference */
+static void modev_free_shm(void *shm)
+{
+	free_page((unsigned long)shm);
+}
+
 /* Get called when matched platform device is found */
 static int modbusplatform_driver_probe(struct platform_device *pdev)
 {
@@ -240,25 +267,67 @@ static int modbusplatform_driver_probe(struct platform_device *pdev)
 
 	/* 2.5. Save private data into pdev (using in remove) */
 	dev_set_drvdata(dev, dev_data);
+	/* The device talks on the bus of its parent controller node */
+	dev_data->bus = modbus_bus_from_device(dev->parent);
+	if (!dev_data->bus)
+	{
+		dev_err(dev, "Parent is not a Modbus controller\n");
+		reval = -ENODEV;
+		goto out;
+	}
 	dev_data->inval_sampl = INTERVAL;
 	dev_data->timeout = TIMEOUT;
 	dev_data->perm = RD_WR;
+	seqlock_init(&dev_data->sample_lock);
+	dev_data->sample.status = -EAGAIN;
+	init_waitqueue_head(&dev_data->sample_wq);
+	dev_data->poller.poll = modbus_poll_values;
 	/* 3. Copy the reference of platform data into private data */
 	dev_data->pdata = pdata;
+	dev_data->num_val = (driver_data == CO_SENSOR) ? CO_REG_VAL : PM_REG_VAL;
 	for (int i = 0; i < dev_data->num_val; i++)
 	{
 		dev_info(dev, "Reg[%d] at 0x%x\n", i, dev_data->pdata->reg_address[i]);
 	}
 
-	/* 4. Dynamically allocate memory for the device buffer */
-	uint8_t num_val = dev_data->num_val;
-	dev_data->buffer = devm_kzalloc(dev, num_val * sizeof(*(dev_data->buffer)), GFP_KERNEL);
-	if (!dev_data->buffer)
+	/* 4. Group the value registers into the fewest read requests */
+	reval = modev_build_read_plan(dev, dev_data);
+	if (reval)
+	{
+		dev_err(dev, "Cannot build read plan\n");
+		goto out;
+	}
+
+	/* 4.2. Sample history, filled by the poller */
+	reval = modev_history_init(dev, dev_data);
+	if (reval)
+		goto out;
+
+	/* 4.3. Write cache, flushed in background or on commit/fsync */
+	reval = modev_wcache_init(dev, dev_data);
+	if (reval)
+		goto out;
+
+	/* 4.5. Shared snapshot page, describes the value registers until the first sample */
+	BUILD_BUG_ON(sizeof(struct modev_shm) + MAX_VAL * sizeof(struct modev_shm_entry) > MODEV_SHM_SIZE);
+	dev_data->shm = (struct modev_shm *)get_zeroed_page(GFP_KERNEL);
+	if (!dev_data->shm)
 	{
-		dev_err(dev,"Cannot allocate memory\n");
 		reval = -ENOMEM;
 		goto out;
 	}
+	reval = devm_add_action_or_reset(dev, modev_free_shm, dev_data->shm);
+	if (reval)
+		goto out;
+	dev_data->shm->magic = MODEV_SHM_MAGIC;
+	dev_data->shm->version = MODEV_SHM_VERSION;
+	dev_data->shm->num_entries = dev_data->num_val;
+	for (int i = 0; i < dev_data->num_val; i++)
+	{
+		dev_data->shm->entries[i].slave = pdata->slave_addr;
+		dev_data->shm->entries[i].reg = pdata->reg_address[i];
+		dev_data->shm->entries[i].status = -EAGAIN;
+	}
 
 	/* 5. Get the device number */
 	dev_t base = modrv_data.device_num_base;
@@ -286,17 +355,22 @@ static int modbusplatform_driver_probe(struct platform_device *pdev)
 	/* 8. Create shared sysfs attribute */
 	sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_interval_time.attr);
 	sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_timeout.attr);
+	sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_rtt_estimate.attr);
+	sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_health.attr);
+	sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_stats.attr);
+	sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_stats_window.attr);
 	sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_slave_address.attr);
+	sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_reg_write.attr);
+	sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_commit.attr);
+	sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_write_delay.attr);
 	
 	/* 9. Create specific sysfs attribute based on types */
 	switch(driver_data)
 	{
 		case CO_SENSOR:
 			sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_co_value.attr);
-			dev_data->num_val = CO_REG_VAL;
 		break;
 		case PM_SENSOR:
-			dev_data->num_val = PM_REG_VAL;
 			sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_pm1_0_value.attr);
 			sysfs_create_attr(dev, &dev_data->modbusdevice->kobj, &dev_attr_pm2_5_value.attr);
 #ifdef CONFIG_PM10
@@ -307,6 +381,9 @@ static int modbusplatform_driver_probe(struct platform_device *pdev)
 			break;
 	}
 
+	/* 10. Start background sampling */
+	modbus_poller_add(dev_data->bus, &dev_data->poller);
+
 	dev_info(dev, "Probe was sucessful\n");
 	modrv_data.total_devices++;
 	return 0;
@@ -326,6 +403,8 @@ static void modbusplatform_driver_remove(struct platform_device *pdev)
 {
 	/* 1. Get private data struct of device */
 	struct modev_private_data *dev_data = (struct modev_private_data *)dev_get_drvdata(&pdev->dev);
+	/* 1.5. Stop background sampling before anything is torn down */
+	modbus_poller_remove(dev_data->bus, &dev_data->poller);
 	/* 2. Remove sysfs attributes then unregister device */
 	sysfs_remove_file(&dev_data->modbusdevice->kobj, &dev_attr_interval_time.attr);
 	device_destroy(modrv_data.modbusclass, dev_data->dev_num);
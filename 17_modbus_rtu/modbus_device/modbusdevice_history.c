@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2026 Văn Tiến <tien11102004@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "modbusdevice_sysfs.h"
+#include "modbus_controller.h"
+/* -------------------------------------------------------------------------
+ * Definition
+ * ------------------------------------------------------------------------- */
+#define HIST_DEFAULT_WINDOW	60		/* Samples aggregated by the stats attribute */
+#define HIST_EWMA_SHIFT		16		/* Fixed point of the EWMA */
+
+/* -------------------------------------------------------------------------
+ Internal help function
+ * ------------------------------------------------------------------------- */
+/* Slot of sample @seq of value register @reg, MODEV_HIST_LEN is a power of 2 */
+static struct modev_hist_entry *hist_slot(struct modev_private_data *dev_data, uint32_t reg, uint64_t seq)
+{
+	return &dev_data->hist[reg * MODEV_HIST_LEN + (seq & (MODEV_HIST_LEN - 1))];
+}
+
+/* -------------------------------------------------------------------------
+ * Sample history
+ * ------------------------------------------------------------------------- */
+/*
+ * @brief Allocate the history ring of a device, MODEV_HIST_LEN samples per value register.
+ * @params
+ *	-dev: Platform device, owner of the devm allocations
+ *	-dev_data: Private data with num_val already set
+ * @return 0 on success, negative errno otherwise
+ */
+int modev_history_init(struct device *dev, struct modev_private_data *dev_data)
+{
+	BUILD_BUG_ON(MODEV_HIST_LEN & (MODEV_HIST_LEN - 1));
+	dev_data->hist = devm_kcalloc(dev, dev_data->num_val * MODEV_HIST_LEN, sizeof(*dev_data->hist),
+								  GFP_KERNEL);
+	if (!dev_data->hist)
+		return -ENOMEM;
+	mutex_init(&dev_data->hist_lock);
+	dev_data->hist_window = HIST_DEFAULT_WINDOW;
+	return 0;
+}
+
+/*
+ * @brief Record one sample, the oldest one is overwritten once the ring is full.
+ * @params
+ *	-dev_data: Private data of the device
+ *	-values: Register values, num_val entries, only used if @status is 0
+ *	-timestamp: Time the sample was taken
+ *	-status: Result of the sample
+ */
+void modev_history_add(struct modev_private_data *dev_data, const uint16_t *values,
+					   ktime_t timestamp, int status)
+{
+	mutex_lock(&dev_data->hist_lock);
+	for (int i = 0; i < dev_data->num_val; i++)
+	{
+		struct modev_hist_entry *entry = hist_slot(dev_data, i, dev_data->hist_seq);
+
+		entry->timestamp = ktime_to_ns(timestamp);
+		entry->value = status ? 0 : values[i];
+		entry->status = status;
+	}
+	dev_data->hist_seq++;
+	mutex_unlock(&dev_data->hist_lock);
+}
+
+/*
+ * @brief MODEV_IOC_HISTORY, copy a run of samples of one register to user space.
+ * @params
+ *	-dev_data: Private data of the device
+ *	-ureq: User struct modev_hist_req, updated with the number of entries and the next sample
+ * @return 0 on success, negative errno otherwise
+ */
+long modev_history_ioctl(struct modev_private_data *dev_data, struct modev_hist_req __user *ureq)
+{
+	struct modev_hist_req req;
+	struct modev_hist_entry *entries = NULL;
+	uint64_t first, last;
+	uint32_t count;
+	long ret_val = 0;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+	if (req.reg_index >= dev_data->num_val)
+		return -EINVAL;
+
+	/* 1. Bounce buffer, the ring lock is not held across copy_to_user */
+	count = min_t(uint32_t, req.count, MODEV_HIST_LEN);
+	if (count)
+	{
+		entries = kmalloc_array(count, sizeof(*entries), GFP_KERNEL);
+		if (!entries)
+			return -ENOMEM;
+	}
+
+	/* 2. Clamp the requested run to the samples still in the ring */
+	mutex_lock(&dev_data->hist_lock);
+	last = dev_data->hist_seq;
+	first = last > MODEV_HIST_LEN ? last - MODEV_HIST_LEN : 0;
+	first = clamp(req.since, first, last);
+	count = min_t(uint64_t, count, last - first);
+	for (uint32_t i = 0; i < count; i++)
+		entries[i] = *hist_slot(dev_data, req.reg_index, first + i);
+	mutex_unlock(&dev_data->hist_lock);
+
+	/* 3. Hand them over */
+	req.count = count;
+	req.since = first + count;
+	if (count && copy_to_user(u64_to_user_ptr(req.entries), entries, count * sizeof(*entries)))
+		ret_val = -EFAULT;
+	else if (copy_to_user(ureq, &req, sizeof(req)))
+		ret_val = -EFAULT;
+	kfree(entries);
+	return ret_val;
+}
+
+/* -------------------------------------------------------------------------
+ * Aggregates
+ * ------------------------------------------------------------------------- */
+/*
+ * @brief Rolling min/max/mean/EWMA of every value register over the last
+ * hist_window samples, failed samples are skipped.
+ * One line per register: address min max mean ewma samples, or '-' without samples.
+ */
+ssize_t stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
+	ssize_t len = 0;
+	uint64_t last;
+	uint32_t window;
+
+	mutex_lock(&dev_data->hist_lock);
+	last = dev_data->hist_seq;
+	window = min_t(uint64_t, dev_data->hist_window, last);
+	for (int i = 0; i < dev_data->num_val; i++)
+	{
+		uint16_t min_val = U16_MAX, max_val = 0;
+		uint64_t sum = 0;
+		int64_t ewma = 0;
+		uint32_t samples = 0;
+
+		/* Oldest first, so the EWMA weights the latest samples most */
+		for (uint64_t seq = last - window; seq < last; seq++)
+		{
+			const struct modev_hist_entry *entry = hist_slot(dev_data, i, seq);
+			int64_t value = (int64_t)entry->value << HIST_EWMA_SHIFT;
+
+			if (entry->status)
+				continue;
+			min_val = min(min_val, entry->value);
+			max_val = max(max_val, entry->value);
+			sum += entry->value;
+			/* alpha = 2 / (window + 1), the usual N sample EWMA */
+			ewma = samples ? ewma + div_s64((value - ewma) * 2, dev_data->hist_window + 1) : value;
+			samples++;
+		}
+
+		if (samples)
+			len += sysfs_emit_at(buf, len, "0x%04x %u %u %llu %lld %u\n", dev_data->pdata->reg_address[i],
+								 min_val, max_val, div_u64(sum + samples / 2, samples),
+								 (ewma + (1 << (HIST_EWMA_SHIFT - 1))) >> HIST_EWMA_SHIFT, samples);
+		else
+			len += sysfs_emit_at(buf, len, "0x%04x - - - - 0\n", dev_data->pdata->reg_address[i]);
+	}
+	mutex_unlock(&dev_data->hist_lock);
+	return len;
+}
+
+ssize_t stats_window_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(dev_data->hist_window));
+}
+
+ssize_t stats_window_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
+	uint32_t result;
+	int ret = kstrtou32(buf, 10, &result);
+	if (ret)
+		return ret;
+	if (!result || result > MODEV_HIST_LEN)
+		return -EINVAL;
+	mutex_lock(&dev_data->hist_lock);
+	dev_data->hist_window = result;
+	mutex_unlock(&dev_data->hist_lock);
+	return count;
+}
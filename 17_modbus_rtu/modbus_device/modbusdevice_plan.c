@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2026 Văn Tiến <tien11102004@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <linux/sort.h>
+#include "modbusdevice_sysfs.h"
+#include "modbus_controller.h"
+/* -------------------------------------------------------------------------
+ * Definition
+ * ------------------------------------------------------------------------- */
+/*
+ * Bus cost of one read transaction, counted in characters on the line:
+ *	request ADU:	address + function + start + quantity + CRC	= 8
+ *	response ADU:	address + function + byte count + CRC		= 5 (+ 2 per register)
+ *	silence:		T3.5 after the request and after the response	= 7
+ * Bridging a hole of N unused registers costs 2*N characters in the response,
+ * so two runs are merged whenever the hole is cheaper than a new transaction.
+ */
+#define PLAN_REQ_CHARS		8
+#define PLAN_RSP_CHARS		5
+#define PLAN_T35_CHARS		7
+#define PLAN_TRANS_CHARS	(PLAN_REQ_CHARS + PLAN_RSP_CHARS + PLAN_T35_CHARS)
+#define PLAN_MAX_GAP		(PLAN_TRANS_CHARS / 2)
+
+/* -------------------------------------------------------------------------
+ Internal help function
+ * ------------------------------------------------------------------------- */
+static int cmp_reg(const void *a, const void *b)
+{
+	return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+/* -------------------------------------------------------------------------
+ * Read plan
+ * ------------------------------------------------------------------------- */
+/*
+ * @brief Build the read plan of a device from its register address list.
+ * @params
+ *	-dev: Platform device, owner of the devm allocations
+ *	-dev_data: Private data with pdata and num_val already set
+ * @return 0 on success, negative errno otherwise
+ */
+int modev_build_read_plan(struct device *dev, struct modev_private_data *dev_data)
+{
+	uint32_t num_val = dev_data->num_val;
+	uint16_t sorted[MAX_VAL];
+	struct modev_read_span *span;
+
+	if (!num_val || num_val > MAX_VAL)
+		return -EINVAL;
+
+	/* 1. Sort a copy of the register addresses */
+	for (int i = 0; i < num_val; i++)
+	{
+		uint32_t reg_addr = dev_data->pdata->reg_address[i];
+		if (reg_addr > U16_MAX)
+		{
+			dev_err(dev, "Register address 0x%x out of range\n", reg_addr);
+			return -EINVAL;
+		}
+		sorted[i] = reg_addr;
+	}
+	sort(sorted, num_val, sizeof(*sorted), cmp_reg, NULL);
+
+	/* 2. At most one span per register */
+	dev_data->spans = devm_kcalloc(dev, num_val, sizeof(*dev_data->spans), GFP_KERNEL);
+	if (!dev_data->spans)
+		return -ENOMEM;
+
+	/* 3. Walk the sorted addresses, extend the current span while it pays off */
+	span = dev_data->spans;
+	span->start = sorted[0];
+	span->count = 1;
+	for (int i = 1; i < num_val; i++)
+	{
+		uint32_t end = span->start + span->count;	/* First register after the span */
+		uint16_t reg_addr = sorted[i];
+
+		if (reg_addr < end)
+			continue;	/* Duplicated address, already covered */
+		if (reg_addr - end <= PLAN_MAX_GAP &&
+				reg_addr - span->start < MODBUS_MAX_READ_REGS)
+		{
+			span->count = reg_addr - span->start + 1;
+			continue;
+		}
+		span++;
+		span->start = reg_addr;
+		span->count = 1;
+	}
+	dev_data->num_spans = span - dev_data->spans + 1;
+
+	for (int i = 0; i < dev_data->num_spans; i++)
+	{
+		dev_info(dev, "Read plan[%d]: FC%02u 0x%04x x %u\n", i, dev_data->pdata->function,
+				dev_data->spans[i].start, dev_data->spans[i].count);
+	}
+	return 0;
+}
+
+/*
+ * @brief Copy the registers of one span response into the device values.
+ * @params
+ *	-dev_data: Private data of the device
+ *	-span: The span that was read
+ *	-regs: span->count register values, regs[0] is register span->start
+ *	-values: Destination, one entry per value register
+ */
+void modev_scatter_span(struct modev_private_data *dev_data, const struct modev_read_span *span,
+						const uint16_t *regs, uint16_t *values)
+{
+	for (int i = 0; i < dev_data->num_val; i++)
+	{
+		uint32_t reg_addr = dev_data->pdata->reg_address[i];
+		if (reg_addr >= span->start && reg_addr < span->start + span->count)
+			values[i] = regs[reg_addr - span->start];
+	}
+}
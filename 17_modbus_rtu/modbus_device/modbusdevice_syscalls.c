@@ -26,6 +26,7 @@
  * ------------------------------------------------------------------------- */
 #define WRITE_INTERVAL	0x01
 #define WRITE_TIMEOUT	0x02
+#define WRITE_REGISTER	0x03	/* Value: register index << 16 | register value */
 /* -------------------------------------------------------------------------
  Internal help function
  * ------------------------------------------------------------------------- */
@@ -45,55 +46,207 @@ static int check_permission(uint32_t dev_per, uint32_t acc_mode)
 }
 
 /* 
- * @brief Read all data value of modbus device, helper function for show values related functions.
+ * @brief Refresh all data value of modbus device, following its read plan.
+ * All spans are queued on the bus at once, then collected in order.
  * @params
- *	-dev: Pointer to sysfs device created in
+ *	-modb_data: Private data of the device
+ *	-values: Destination of the values, num_val entries
  * @return The error send state, or NOERROR if read successful
  */
-static int modbus_read_value(struct device *dev)
+static int modbus_refresh_values(struct modev_private_data *modb_data, uint16_t *values)
 {
+	uint32_t timeout = READ_ONCE(modb_data->timeout);
 	int ret_val = 0;
-    struct modev_private_data *modb_data = dev_get_drvdata(dev->parent);
-	uint8_t num_val = modb_data->num_val;
-	ktime_t previous_read = modb_data->previous_read;
-	/* Reuse the previous sucessfull reading if can 
-	 *	ktime_ms_delta(a, b) returns a - b in milliseconds, 
-	 *	so this is now - last_read_time > interval, we will read again
-	 * */
-	ktime_t now = ktime_get();
-	if (!previous_read || ktime_ms_delta(now,previous_read) > modb_data->inval_sampl)
+	int submitted;
+
+	/* 1. Queue one transaction per span, the bus sends them back to back */
+	for (submitted = 0; submitted < modb_data->num_spans; submitted++)
+	{
+		struct modev_read_span *span = &modb_data->spans[submitted];
+
+		span->xfer.address	= modb_data->pdata->slave_addr;
+		span->xfer.function	= modb_data->pdata->function;
+		span->xfer.start	= span->start;
+		span->xfer.quantity	= span->count;
+		span->xfer.timeout	= timeout;
+		span->xfer.values	= span->regs;
+		span->xfer.complete	= NULL;
+		ret_val = modbus_submit(modb_data->bus, &span->xfer);
+		if (ret_val)
+			break;
+	}
+
+	/* 2. Collect the results, every queued transaction must be waited for */
+	for (int i = 0; i < submitted; i++)
 	{
-		for(int i = 0; i < num_val; i++)
+		struct modev_read_span *span = &modb_data->spans[i];
+		int err = modbus_send_errno(modbus_xfer_wait(&span->xfer));
+
+		if (!err && span->xfer.count != span->count)
+			err = -EPROTO;
+		if (err)
 		{
-			uint32_t reg_addr = modb_data->pdata->reg_address[i];
-			SendRetType err = ModbusSend(modb_data->pdata->slave_addr, 3, reg_addr,1,1000);
-			switch (err)
-			{
-				case ESEND_NOERR:
-					uint16_t rec_len = 0;
-					ModbusReceive((char*)&modb_data->buffer[i],&rec_len);
-					pr_info("Recive %d bytes from modbus slave\n",rec_len);
-					break;
-				case ESEND_RQINVAL:
-					ret_val = -EINVAL;
-					goto out;
-					break;
-				case ESEND_RPINVAL:
-					ret_val = -EPROTO;
-					goto out;
-					break;
-				case ESEND_TIMEOUT:
-					ret_val = -ETIMEDOUT;
-					goto out;
-					break;
-			}
+			if (!ret_val)
+				ret_val = err;
+			continue;
 		}
-		modb_data->previous_read = now;
+		mb_dbg("Recive %d registers from modbus slave\n",span->xfer.count);
+		modev_scatter_span(modb_data, span, span->regs, values);
 	}
-    return 0;
-out:
 	return ret_val;
 }
+
+/* 
+ * @brief Copy the sample into the page mapped by user space, under its own seqcount.
+ * Called with sample_lock held for writing, so there is a single writer.
+ */
+static void modbus_publish_shm(struct modev_private_data *modb_data)
+{
+	struct modev_shm *shm = modb_data->shm;
+	const struct modev_sample *sample = &modb_data->sample;
+
+	WRITE_ONCE(shm->seq, shm->seq + 1);
+	smp_wmb();
+	for (int i = 0; i < modb_data->num_val; i++)
+	{
+		WRITE_ONCE(shm->entries[i].value, sample->values[i]);
+		WRITE_ONCE(shm->entries[i].status, sample->status);
+		WRITE_ONCE(shm->entries[i].timestamp, ktime_to_ns(sample->timestamp));
+	}
+	WRITE_ONCE(shm->generation, sample->generation);
+	smp_wmb();
+	WRITE_ONCE(shm->seq, shm->seq + 1);
+}
+
+/* 
+ * @brief Publish a new sample, readers see either the old or the new one as a whole.
+ * The values and the timestamp are only replaced by a successful sample.
+ * @params
+ *	-modb_data: Private data of the device
+ *	-values: New register values, num_val entries
+ *	-timestamp: Capture time of @values
+ *	-status: Result of the sample
+ */
+static void modbus_publish_sample(struct modev_private_data *modb_data, const uint16_t *values,
+								  ktime_t timestamp, int status)
+{
+	write_seqlock(&modb_data->sample_lock);
+	if (!status)
+	{
+		memcpy(modb_data->sample.values, values, modb_data->num_val * sizeof(*values));
+		modb_data->sample.timestamp = timestamp;
+	}
+	modb_data->sample.status = status;
+	modb_data->sample.generation++;
+	modbus_publish_shm(modb_data);
+	write_sequnlock(&modb_data->sample_lock);
+}
+
+/* 
+ * @brief Take a consistent copy of the latest sample, never blocks the poller.
+ * @params
+ *	-modb_data: Private data of the device
+ *	-snap: Destination of the copy
+ */
+static void modbus_get_sample(struct modev_private_data *modb_data, struct modev_sample *snap)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&modb_data->sample_lock);
+		*snap = modb_data->sample;
+	} while (read_seqretry(&modb_data->sample_lock, seq));
+}
+
+/* 
+ * @brief Current status of the latest sample, wait condition of the readers.
+ */
+static int modbus_sample_status(struct modev_private_data *modb_data)
+{
+	unsigned int seq;
+	int status;
+
+	do {
+		seq = read_seqbegin(&modb_data->sample_lock);
+		status = modb_data->sample.status;
+	} while (read_seqretry(&modb_data->sample_lock, seq));
+	return status;
+}
+
+/* 
+ * @brief Generation of the latest sample, compared against the one a file last read.
+ */
+static uint32_t modbus_sample_generation(struct modev_private_data *modb_data)
+{
+	unsigned int seq;
+	uint32_t generation;
+
+	do {
+		seq = read_seqbegin(&modb_data->sample_lock);
+		generation = modb_data->sample.generation;
+	} while (read_seqretry(&modb_data->sample_lock, seq));
+	return generation;
+}
+
+/* 
+ * @brief Wait until the device has been sampled once, then copy the latest sample.
+ * @params
+ *	-modb_data: Private data of the device
+ *	-nonblock: Do not wait for the first sample
+ *	-snap: Destination of the sample
+ * @return 0 if the snapshot holds valid values, negative errno otherwise
+ */
+static int modbus_wait_sample(struct modev_private_data *modb_data, bool nonblock,
+							  struct modev_sample *snap)
+{
+	if (modbus_sample_status(modb_data) == -EAGAIN)
+	{
+		if (nonblock)
+			return -EAGAIN;
+		if (wait_event_interruptible(modb_data->sample_wq,
+					modbus_sample_status(modb_data) != -EAGAIN))
+			return -ERESTARTSYS;
+	}
+	modbus_get_sample(modb_data, snap);
+	return snap->status;
+}
+
+/* 
+ * @brief Read all data value of modbus device, helper function for show values related functions.
+ * The values come from the latest background sample, the bus is not touched.
+ * @params
+ *	-dev: Pointer to sysfs device created in
+ *	-snap: Destination of the sample
+ * @return The error send state, or NOERROR if read successful
+ */
+static int modbus_read_value(struct device *dev, struct modev_sample *snap)
+{
+    struct modev_private_data *modb_data = dev_get_drvdata(dev->parent);
+	return modbus_wait_sample(modb_data, false, snap);
+}
+
+/* -------------------------------------------------------------------------
+ * Background sampling
+ * ------------------------------------------------------------------------- */
+/* 
+ * @brief Poll callback of the device, called from the controller poller thread.
+ * @params
+ *	-client: Poll client embedded in the device private data
+ * @return Delay in ms until the next sample
+ */
+uint32_t modbus_poll_values(struct modbus_poll_client *client)
+{
+	struct modev_private_data *modb_data = container_of(client, struct modev_private_data, poller);
+	uint16_t values[MAX_VAL];
+	ktime_t now = ktime_get();
+	int ret_val = modbus_refresh_values(modb_data, values);
+
+	modbus_publish_sample(modb_data, values, now, ret_val);
+	modev_history_add(modb_data, values, now, ret_val);
+	wake_up_interruptible_all(&modb_data->sample_wq);
+	return READ_ONCE(modb_data->inval_sampl);
+}
+
 /* -------------------------------------------------------------------------
  * Sysfs Callbacks
  * ------------------------------------------------------------------------- */
@@ -112,6 +265,7 @@ ssize_t interval_store(struct device *dev, struct device_attribute *attr, const
 	if (ret)
 		return ret;
 	dev_data->inval_sampl = result;
+	modbus_poller_kick(dev_data->bus, &dev_data->poller);
 	return count;
 }
 
@@ -128,10 +282,35 @@ ssize_t timeout_store(struct device *dev, struct device_attribute *attr, const c
 	int ret = kstrtou32(buf, 10, &result);
 	if (ret)
 		return ret;
-	dev_data->timeout = result;
+	if (!result)
+		return -EINVAL;
+	WRITE_ONCE(dev_data->timeout, result);
 	return count;
 }
 
+ssize_t rtt_estimate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
+	struct modbus_rtt_estimate est;
+
+	modbus_rtt_get(dev_data->bus, dev_data->pdata->slave_addr, READ_ONCE(dev_data->timeout), &est);
+	return sysfs_emit(buf, "%u %u %u\n", est.srtt_us, est.rttvar_us, est.timeout_us);
+}
+
+ssize_t health_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	static const char * const breaker_names[] = {
+		[MODBUS_BREAKER_CLOSED]		= "closed",
+		[MODBUS_BREAKER_OPEN]		= "open",
+		[MODBUS_BREAKER_HALF_OPEN]	= "half-open",
+	};
+	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
+	struct modbus_slave_health health;
+
+	modbus_health_get(dev_data->bus, dev_data->pdata->slave_addr, &health);
+	return sysfs_emit(buf, "%s %u %u\n", breaker_names[health.breaker], health.failures, health.backoff);
+}
+
 ssize_t slave_address_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
@@ -140,56 +319,56 @@ ssize_t slave_address_show(struct device *dev, struct device_attribute *attr, ch
 
 ssize_t co_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	int ret_val = modbus_read_value(dev);
+	struct modev_sample snap;
+	int ret_val = modbus_read_value(dev, &snap);
 	if(ret_val < 0)
 	{
 		return ret_val;
 	}
-	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
-	return sysfs_emit(buf, "%d\n", *(dev_data->buffer));
+	return sysfs_emit(buf, "%d\n", snap.values[0]);
 }
 
 ssize_t pm1_0_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	int ret_val = modbus_read_value(dev);
+	struct modev_sample snap;
+	int ret_val = modbus_read_value(dev, &snap);
 	if(ret_val < 0)
 	{
 		return ret_val;
 	}
-	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
-	return sysfs_emit(buf, "%d\n", dev_data->buffer[0]);
+	return sysfs_emit(buf, "%d\n", snap.values[0]);
 }
 		
 ssize_t pm2_5_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	int ret_val = modbus_read_value(dev);
+	struct modev_sample snap;
+	int ret_val = modbus_read_value(dev, &snap);
 	if(ret_val < 0)
 	{
 		return ret_val;
 	}
-	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
-	return sysfs_emit(buf, "%d\n", dev_data->buffer[1]);
+	return sysfs_emit(buf, "%d\n", snap.values[1]);
 }
 
 ssize_t pm10_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	int ret_val = modbus_read_value(dev);
+	struct modev_sample snap;
+	int ret_val = modbus_read_value(dev, &snap);
 	if(ret_val < 0)
 	{
 		return ret_val;
 	}
-	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
-	return sysfs_emit(buf, "%d\n", dev_data->buffer[3]);
+	return sysfs_emit(buf, "%d\n", snap.values[2]);
 }
 
 /* File oprations */
 loff_t modbus_llseek (struct file *filp, loff_t off, int whence)
 {
-    pr_info("lseek requested\n");
+    mb_dbg("lseek requested\n");
     loff_t temp; 
     /* Extract private data from file pointer */
-    struct modev_private_data *modb_data = (struct modev_private_data*)filp->private_data;
-	unsigned max_size = modb_data->num_val * sizeof(*modb_data->buffer);
+    struct modev_private_data *modb_data = ((struct modev_file*)filp->private_data)->modb_data;
+	unsigned max_size = modb_data->num_val * sizeof(*modb_data->sample.values);
     switch (whence){
 	    case SEEK_SET:
 		    if (off > max_size || off < 0)
@@ -216,80 +395,59 @@ loff_t modbus_llseek (struct file *filp, loff_t off, int whence)
 
 int modbus_open (struct inode *inode, struct file * filp)
 {
-    pr_info("open was was called\n");
+    mb_dbg("open was was called\n");
     /* Find out what device file open was attemped by user space */
     int minor = MINOR(inode->i_rdev);
     int ret_val;
-    pr_info("minor number = %d\n",minor); 
+    mb_dbg("minor number = %d\n",minor); 
     struct modev_private_data *modb_data;
+	struct modev_file *mfile;
     /* Get private data struce */
     modb_data = container_of (inode->i_cdev,struct modev_private_data,cdev);
-    /* Save data into private data of file structure (using for other method) */
-    filp->private_data = modb_data;
 
     /* Check permission */
     ret_val = check_permission(modb_data->perm, filp->f_mode);
     if (!ret_val)
     {
-		pr_info ("Open was succesful\n");
+		mb_dbg("Open was succesful\n");
     }
     else 
 	{
-		pr_info ("Open with unacceptable permission\n");
+		mb_dbg("Open with unacceptable permission\n");
 		return ret_val;	
     }
+
+	/* Per file state, a new file has not read any sample yet */
+	mfile = kzalloc(sizeof(*mfile), GFP_KERNEL);
+	if (!mfile)
+		return -ENOMEM;
+	mfile->modb_data = modb_data;
+    /* Save data into private data of file structure (using for other method) */
+    filp->private_data = mfile;
     return 0;
 }
 
 ssize_t modbus_read (struct file *filp, char __user *buff, size_t count, loff_t *f_pos)
 {
     int ret_val = 0;
-    pr_info("read requested for %zu bytes\n",count);
-    pr_info("current file postions = %lld\n",*f_pos);
+    mb_dbg("read requested for %zu bytes\n",count);
+    mb_dbg("current file postions = %lld\n",*f_pos);
     /* Extract private data from file pointer */
-    struct modev_private_data *modb_data = (struct modev_private_data*)filp->private_data;
-	uint8_t num_val = modb_data->num_val;
-	ktime_t previous_read = modb_data->previous_read;
-	/* Reuse the previous sucessfull reading if can 
-	 *	ktime_ms_delta(a, b) returns a - b in milliseconds, 
-	 *	so this is now - last_read_time > interval, we will read again
-	 * */
-	ktime_t now = ktime_get();
-	if (!previous_read || ktime_ms_delta(now,previous_read) > modb_data->inval_sampl)
-	{
-		for(int i = 0; i < num_val; i++)
-		{
-			uint32_t reg_addr = modb_data->pdata->reg_address[i];
-			SendRetType err = ModbusSend(modb_data->pdata->slave_addr, 3, reg_addr,1,1000);
-			switch (err)
-			{
-				case ESEND_NOERR:
-					uint16_t rec_len = 0;
-					ModbusReceive((char*)&modb_data->buffer[i],&rec_len);
-					pr_info("Recive %d bytes from modbus slave\n",rec_len);
-					break;
-				case ESEND_RQINVAL:
-					ret_val = -EINVAL;
-					goto out;
-					break;
-				case ESEND_RPINVAL:
-					ret_val = -EPROTO;
-					goto out;
-					break;
-				case ESEND_TIMEOUT:
-					ret_val = -ETIMEDOUT;
-					goto out;
-					break;
-			}
-		}
-		modb_data->previous_read = now;
-	}
-    unsigned max_size = modb_data->num_val * sizeof(*modb_data->buffer);
+    struct modev_file *mfile = filp->private_data;
+    struct modev_private_data *modb_data = mfile->modb_data;
+	struct modev_sample snap;
+	ret_val = modbus_wait_sample(modb_data, filp->f_flags & O_NONBLOCK, &snap);
+	/* The sample is consumed by this file, even if it only carries an error */
+	if (ret_val != -EAGAIN && ret_val != -ERESTARTSYS)
+		WRITE_ONCE(mfile->generation, snap.generation);
+	if (ret_val < 0)
+		goto out;
+    unsigned max_size = modb_data->num_val * sizeof(*snap.values);
     /* Adjust the 'count' */
     if ((*f_pos + count ) > max_size)
 	    count = max_size - *f_pos;
-    /*Copy to user*/
-    ret_val = copy_to_user(buff,modb_data->buffer + *(f_pos),count);
+    /*Copy to user, f_pos counts bytes*/
+    ret_val = copy_to_user(buff,(char *)snap.values + *(f_pos),count);
     if (ret_val)
 	{
 		ret_val = -EFAULT;
@@ -299,8 +457,8 @@ ssize_t modbus_read (struct file *filp, char __user *buff, size_t count, loff_t
     *f_pos += count;
 
     /* Return number of bytes which have been successfully read*/
-    pr_info("Number of bytes successfully read = %zu\n",count);
-    pr_info("Updated file positon = %lld\n",*f_pos);
+    mb_dbg("Number of bytes successfully read = %zu\n",count);
+    mb_dbg("Updated file positon = %lld\n",*f_pos);
     return count;
 out:
 	return ret_val;
@@ -308,16 +466,17 @@ out:
 
 ssize_t modbus_write (struct file *filp, const char __user *buff, size_t count, loff_t *f_pos)
 {
-    pr_info("write requested for %zu bytes\n",count);
-    pr_info("current file postions = %lld\n",*f_pos);
+    mb_dbg("write requested for %zu bytes\n",count);
+    mb_dbg("current file postions = %lld\n",*f_pos);
     /* Extract private data from file pointer */
-    struct modev_private_data *modb_data = (struct modev_private_data*)filp->private_data;
+    struct modev_private_data *modb_data = ((struct modev_file*)filp->private_data)->modb_data;
 	/* Local kernel buffer to hold incoming command
 	 * [1byte] Function code [4byte (uint32_t)] Value
 	 */
 	uint8_t kbuf[5]; 
 	uint8_t fn_code;
 	uint32_t val;
+	int ret_val;
 	if (count != sizeof(kbuf))
 	{
 		pr_err("Write method passed error size\n");
@@ -336,11 +495,21 @@ ssize_t modbus_write (struct file *filp, const char __user *buff, size_t count,
     switch (fn_code) {
         case WRITE_INTERVAL:
 			modb_data->inval_sampl = val; 
-            pr_info("Function %d: Interval time set to %u\n", fn_code, val);
+			modbus_poller_kick(modb_data->bus, &modb_data->poller);
+            mb_dbg("Function %d: Interval time set to %u\n", fn_code, val);
             break;
 		case WRITE_TIMEOUT:
-			modb_data->timeout = val;	
-			pr_info("Function %d: Time out set to %u\n", fn_code, val);
+			if (!val)
+				return -EINVAL;
+			WRITE_ONCE(modb_data->timeout, val);
+			mb_dbg("Function %d: Time out set to %u\n", fn_code, val);
+			break;
+		case WRITE_REGISTER:
+			/* Cached, the slave is written back later (see modev_wcache_write) */
+			ret_val = modev_wcache_write(modb_data, val >> 16, val & 0xffff);
+			if (ret_val)
+				return ret_val;
+			mb_dbg("Function %d: Register %u set to %u\n", fn_code, val >> 16, val & 0xffff);
 			break;
         default:
             pr_warn("Unknown function code: 0x%02x\n", fn_code);
@@ -350,8 +519,206 @@ ssize_t modbus_write (struct file *filp, const char __user *buff, size_t count,
     return count;
 }
 
+/*
+ * @brief Write every dirty register of the write cache to the slave.
+ */
+int modbus_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+	struct modev_private_data *modb_data = ((struct modev_file*)filp->private_data)->modb_data;
+
+	return modev_wcache_flush(modb_data);
+}
+
 int modbus_release (struct inode *inode, struct file *filp)
 {
-    pr_info("close was sucessful\n");
+	kfree(filp->private_data);
+    mb_dbg("close was sucessful\n");
     return 0;
 }
+
+/*
+ * @brief Readable once the device published a sample this file has not read yet.
+ * Every sample wakes sample_wq, so poll()/epoll sleep until the next one
+ * instead of spinning on read(). Writes never block.
+ */
+__poll_t modbus_poll(struct file *filp, poll_table *wait)
+{
+	struct modev_file *mfile = filp->private_data;
+	struct modev_private_data *modb_data = mfile->modb_data;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &modb_data->sample_wq, wait);
+	if (modbus_sample_generation(modb_data) != READ_ONCE(mfile->generation))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (filp->f_mode & FMODE_WRITE)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
+/*
+ * @brief Maps the shared snapshot page of the device, read-only.
+ * The layout is struct modev_shm, see modbusdevice_uapi.h.
+ */
+int modbus_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct modev_private_data *modb_data = ((struct modev_file*)filp->private_data)->modb_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	/* Never writable, not even through mprotect(..) later */
+	vm_flags_clear(vma, VM_MAYWRITE);
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(modb_data->shm));
+}
+
+/*
+ * @brief MODEV_IOC_BATCH, run a list of transactions back to back on the bus of the device.
+ * @params
+ *	-modb_data: Private data of the device
+ *	-ubatch: User struct modev_batch
+ * @return 0 when every operation has a result, negative errno otherwise
+ */
+static long modbus_ioctl_batch(struct modev_private_data *modb_data, struct modev_batch __user *ubatch)
+{
+	struct modev_batch batch;
+	struct modev_batch_op *ops;
+	struct modbus_xfer *xfers;
+	uint16_t (*values)[MODEV_BATCH_MAX_READ];
+	uint16_t (*wvalues)[MODEV_BATCH_MAX_WRITE];
+	uint8_t op_index[MODEV_BATCH_MAX];		/* Operation of each queued transaction */
+	unsigned int num_xfers = 0;
+	uint32_t timeout = READ_ONCE(modb_data->timeout);
+	long ret_val = 0;
+
+	BUILD_BUG_ON(MODEV_BATCH_MAX_READ > MODBUS_MAX_READ_REGS);
+	BUILD_BUG_ON(MODEV_BATCH_MAX_WRITE > MODBUS_MAX_WRITE_REGS);
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.num_ops || batch.num_ops > MODEV_BATCH_MAX || batch.reserved)
+		return -EINVAL;
+
+	/* 1. Copy the operations in, with room for the transactions and their values */
+	ops = memdup_user(u64_to_user_ptr(batch.ops), batch.num_ops * sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+	xfers = kcalloc(batch.num_ops, sizeof(*xfers), GFP_KERNEL);
+	values = kcalloc(batch.num_ops, sizeof(*values), GFP_KERNEL);
+	wvalues = kcalloc(batch.num_ops, sizeof(*wvalues), GFP_KERNEL);
+	if (!xfers || !values || !wvalues)
+	{
+		ret_val = -ENOMEM;
+		goto out;
+	}
+
+	/* 2. Check every operation, a bad one only fails itself and is not queued */
+	for (int i = 0; i < batch.num_ops; i++)
+	{
+		struct modev_batch_op *op = &ops[i];
+		struct modbus_xfer *xfer;
+		bool read = (op->function >= 1 && op->function <= 4) || op->function == 23;
+		uint16_t nwrite = 0;
+
+		op->count = 0;
+		op->status = 0;
+		switch (op->function)
+		{
+			case 1:
+			case 2:
+			case 3:
+			case 4:
+			case 5:
+			case 6:
+				break;
+			case 15:
+			case 16:
+				nwrite = op->quantity;
+				if (!nwrite || nwrite > MODEV_BATCH_MAX_WRITE)
+					op->status = -EINVAL;
+				break;
+			case 23:
+				nwrite = op->write_quantity;
+				if (!nwrite || nwrite > MODBUS_MAX_RW_WRITE_REGS)
+					op->status = -EINVAL;
+				break;
+			default:
+				op->status = -EINVAL;
+				break;
+		}
+		if (!op->slave || op->slave > 247 ||
+				(op->function != 23 && (op->write_start || op->write_quantity)) ||
+				(read && (!op->quantity || op->quantity > MODEV_BATCH_MAX_READ)))
+			op->status = -EINVAL;
+		if (!op->status && nwrite &&
+				copy_from_user(wvalues[i], u64_to_user_ptr(op->write_values), nwrite * sizeof(wvalues[i][0])))
+			op->status = -EFAULT;
+		if (op->status)
+			continue;
+
+		/* Only valid operations are queued, packed at the front of xfers */
+		op_index[num_xfers] = i;
+		xfer = &xfers[num_xfers++];
+		xfer->address		= op->slave;
+		xfer->function		= op->function;
+		xfer->start			= op->start;
+		xfer->quantity		= op->quantity;
+		xfer->write_start	= op->write_start;
+		xfer->write_quantity	= op->write_quantity;
+		xfer->write_values	= nwrite ? wvalues[i] : NULL;
+		xfer->timeout		= timeout;
+		xfer->values		= read ? values[i] : NULL;
+		xfer->complete		= NULL;
+	}
+
+	/* 3. Queue the valid ones in one go, then collect every result */
+	if (num_xfers)
+	{
+		ret_val = modbus_submit_batch(modb_data->bus, xfers, num_xfers);
+		if (ret_val)
+			goto out;
+	}
+	for (unsigned int n = 0; n < num_xfers; n++)
+	{
+		int i = op_index[n];
+		struct modev_batch_op *op = &ops[i];
+
+		op->status = modbus_send_errno(modbus_xfer_wait(&xfers[n]));
+		if (op->status || !xfers[n].values)
+			continue;
+		op->count = xfers[n].count;
+		if (copy_to_user(u64_to_user_ptr(op->values), values[i], op->count * sizeof(values[i][0])))
+			op->status = -EFAULT;
+	}
+
+	/* 4. Per operation results */
+	if (copy_to_user(u64_to_user_ptr(batch.ops), ops, batch.num_ops * sizeof(*ops)))
+		ret_val = -EFAULT;
+out:
+	kfree(wvalues);
+	kfree(values);
+	kfree(xfers);
+	kfree(ops);
+	return ret_val;
+}
+
+/*
+ * @brief ioctl commands of the device file, see modbusdevice_uapi.h.
+ */
+long modbus_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct modev_private_data *modb_data = ((struct modev_file*)filp->private_data)->modb_data;
+
+	switch (cmd)
+	{
+		case MODEV_IOC_HISTORY:
+			return modev_history_ioctl(modb_data, (struct modev_hist_req __user *)arg);
+		case MODEV_IOC_BATCH:
+			/* Talks to any slave of the bus, writes included */
+			if (!(filp->f_mode & FMODE_WRITE))
+				return -EBADF;
+			return modbus_ioctl_batch(modb_data, (struct modev_batch __user *)arg);
+		default:
+			return -ENOTTY;
+	}
+}
@@ -37,6 +37,15 @@
 #include <linux/mod_devicetable.h>  /* For ID tables (platform_device_id) */
 #include <linux/sysfs.h>            /* For sysfs_create_file / device_attribute */
 #include <linux/ktime.h>			/* For ktime_t, ktimems_delta */
+#include <linux/wait.h>				/* For the new sample wait queue */
+#include <linux/seqlock.h>			/* For the lock-free sample snapshot */
+#include <linux/poll.h>				/* For poll()/epoll on the new sample wait queue */
+#include <linux/mm.h>				/* For mmap of the shared snapshot page */
+#include <linux/mutex.h>			/* For the sample history lock */
+#include <linux/workqueue.h>		/* For the delayed write-back of the register cache */
+#include <linux/bitmap.h>			/* For the dirty registers of the write cache */
+#include "modbus_controller.h"		/* For the background poller client */
+#include "modbusdevice_uapi.h"		/* For the shared snapshot page layout */
 /* -------------------------------------------------------------------------
  * Permission Macros
  * ------------------------------------------------------------------------- */
@@ -64,10 +73,45 @@ typedef enum DEVICE_TYPE {
  * struct modbus_sensor_data - Configuration for a specific Modbus slave
  * @slave_addr:    Modbus station address (from 'reg')
  * @reg_addresses: Array of 16-bit or 32-bit register offsets
+ * @function:      Read function code, 3 (holding) or 4 (input), from 'lsmy,function'
  */
 struct modev_platform_data {
 	uint32_t		slave_addr;
 	uint32_t		*reg_address;
+	uint32_t		function;
+};
+
+/**
+ * struct modev_read_span - One read request of the device read plan
+ * @start:	First register address of the request
+ * @count:	Number of consecutive registers covered by the request
+ * @xfer:	Bus transaction of the span, reused for every sample
+ * @regs:	Values returned by @xfer
+ * * The read plan is built once at probe time from 'lsmy,reg-addresses'.
+ * Registers that are close to each other share one span, the unused
+ * registers in between are read and dropped.
+ */
+struct modev_read_span {
+	uint16_t			start;
+	uint16_t			count;
+	struct modbus_xfer	xfer;
+	uint16_t			regs[MODBUS_MAX_READ_REGS];
+};
+
+/**
+ * struct modev_sample - One published sample of the device values
+ * @values:		Register values, in the 'lsmy,reg-addresses' order
+ * @timestamp:	Capture time of @values (last successful sample)
+ * @status:		Result of the latest sample, -EAGAIN until the first one is taken
+ * @generation:	Number of samples published so far, successful or not
+ * * Written by the poller only, read by any number of readers through
+ * modev_private_data::sample_lock without blocking each other.
+ */
+struct modev_sample {
+	uint16_t		values[MAX_VAL];
+	ktime_t			timestamp;
+	int				status;
+	uint32_t		generation;
 };
 
 /* -------------------------------------------------------------------------
@@ -77,21 +121,38 @@ struct modev_platform_data {
 /**
  * struct modev_private_data - Per-device instance structure
  * @pdata:			Reference to the a platform data
- * @buffer:			Pointer to the dynamically allocated device memory
+ * @bus:			Modbus bus of the parent controller
  * @modbusdevice:	Pointer to the device created in /sys/class
  * @dev_num:		Specific <Major, Minor> pair for this instance
  * @cdev:			Internal character device structure
  * @perm:			Device file permision (not register), now it is always r/w permisison
  * @timeout:		Reading value timeout
- * @inval_sampl:	Interval sampling, avoid reading in a short period of time from multiple user applications 
- * @pre_read:		The lastest time of sucessfull reading 
+ * @inval_sampl:	Interval sampling, period of the background poller for this device
  * @num_val:		The number of value register, using in read callback.
- * * This structure is the "Identity" of each matched device. It is stored 
- * in filp->private_data during open() to be accessible in read/write.
+ * @spans:			Read plan, fewest requests covering all value registers
+ * @num_spans:		Number of entries in @spans
+ * @poller:			Background poller client, samples the device every @inval_sampl
+ * @sample_wq:		Readers waiting for the first sample, and poll()/epoll waiters of every new sample
+ * @sample_lock:	Seqlock publishing @sample, readers retry instead of locking
+ * @sample:			Latest sample of the device
+ * @shm:			Page mapped read-only by user space, copy of @sample kept in sync by the poller
+ * @hist:			Sample history, MODEV_HIST_LEN entries per value register
+ * @hist_seq:		Number of samples recorded in @hist since probe
+ * @hist_window:	Number of samples aggregated by the stats attribute
+ * @hist_lock:		Protects @hist, @hist_seq and @hist_window
+ * @wc_values:		Write cache, value to write per value register
+ * @wc_dirty:		Value registers of @wc_values not written to the slave yet
+ * @wc_delay:		Write-back delay in ms after the first dirty register, 0 writes through
+ * @wc_lock:		Protects @wc_values and @wc_dirty
+ * @wc_flush_lock:	Serializes flushes, owns @wc_xfers
+ * @wc_work:		Delayed write-back of the dirty registers
+ * @wc_xfers:		FC16 transactions of one flush, one per run of consecutive registers
+ * * This structure is the "Identity" of each matched device. The
+ * modev_file of every open() points to it.
  */
 struct modev_private_data {
 	struct modev_platform_data	*pdata; 
-	uint16_t					*buffer;
+	struct modbus_bus			*bus;
 	struct device				*modbusdevice; 
 	dev_t						dev_num; 
 	struct cdev					cdev;
@@ -99,7 +160,37 @@ struct modev_private_data {
 	uint32_t					inval_sampl;
 	uint32_t					timeout;
 	uint32_t					num_val;					
-	ktime_t						previous_read;
+	struct modev_read_span		*spans;
+	uint32_t					num_spans;
+	struct modbus_poll_client	poller;
+	wait_queue_head_t			sample_wq;
+	seqlock_t					sample_lock;
+	struct modev_sample			sample;
+	struct modev_shm			*shm;
+	struct modev_hist_entry		*hist;
+	uint64_t					hist_seq;
+	uint32_t					hist_window;
+	struct mutex				hist_lock;
+	uint16_t					wc_values[MAX_VAL];
+	DECLARE_BITMAP(wc_dirty, MAX_VAL);
+	uint32_t					wc_delay;
+	struct mutex				wc_lock;
+	struct mutex				wc_flush_lock;
+	struct delayed_work			wc_work;
+	struct modbus_xfer			*wc_xfers;
+};
+
+/**
+ * struct modev_file - Per open() state of the character device
+ * @modb_data:	Device the file was opened on
+ * @generation:	Sample generation this file last read, poll() reports
+ *				readable while the device has a newer one
+ * * Stored in filp->private_data, so each file descriptor tracks the
+ * samples it consumed on its own.
+ */
+struct modev_file {
+	struct modev_private_data	*modb_data;
+	uint32_t					generation;
 };
 
 /**
@@ -128,12 +219,44 @@ ssize_t interval_store(struct device *dev, struct device_attribute *attr, const
 
 ssize_t timeout_show(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t timeout_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t rtt_estimate_show(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t health_show(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t slave_address_show(struct device *dev, struct device_attribute *attr, char *buf);
 /* Specific attribute */
 ssize_t co_show(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t pm1_0_show(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t pm2_5_show(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t pm10_show(struct device *dev, struct device_attribute *attr, char *buf);
+/*
+ * for Background sampling
+ * */
+uint32_t modbus_poll_values(struct modbus_poll_client *client);
+/*
+ * for Read plan
+ * */
+int modev_build_read_plan(struct device *dev, struct modev_private_data *dev_data);
+void modev_scatter_span(struct modev_private_data *dev_data, const struct modev_read_span *span,
+						const uint16_t *regs, uint16_t *values);
+/*
+ * for Sample history
+ * */
+int modev_history_init(struct device *dev, struct modev_private_data *dev_data);
+void modev_history_add(struct modev_private_data *dev_data, const uint16_t *values,
+					   ktime_t timestamp, int status);
+long modev_history_ioctl(struct modev_private_data *dev_data, struct modev_hist_req __user *ureq);
+ssize_t stats_show(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t stats_window_show(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t stats_window_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+/*
+ * for Write cache
+ * */
+int modev_wcache_init(struct device *dev, struct modev_private_data *dev_data);
+int modev_wcache_write(struct modev_private_data *dev_data, uint32_t index, uint16_t value);
+int modev_wcache_flush(struct modev_private_data *dev_data);
+ssize_t commit_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t write_delay_show(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t write_delay_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t reg_write_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 /*
  * for File Operations (Syscalls) 
  * */
@@ -142,4 +265,8 @@ int modbus_open(struct inode *inode, struct file *filp);
 ssize_t modbus_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos);
 ssize_t modbus_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos);
 int modbus_release(struct inode *inode, struct file *filp);
+int modbus_fsync(struct file *filp, loff_t start, loff_t end, int datasync);
+__poll_t modbus_poll(struct file *filp, poll_table *wait);
+int modbus_mmap(struct file *filp, struct vm_area_struct *vma);
+long modbus_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 #endif /* SERDEV_DRIVER_DT_SYSFS_H */
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2026 Văn Tiến <tien11102004@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef MODBUSDEVICE_UAPI_H
+#define MODBUSDEVICE_UAPI_H
+
+/*
+ * User space interface of the modbus device character devices, everything
+ * beyond plain read(..) / write(..). This header is shared with user space
+ * and must only use fixed size types.
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* -------------------------------------------------------------------------
+ * Shared snapshot page (mmap)
+ * ------------------------------------------------------------------------- */
+/*
+ * mmap(NULL, MODEV_SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0) on /dev/<device>
+ * maps one read-only page holding the latest sample of the device, updated
+ * in place by the driver every time a sample is taken.
+ *
+ * Reading without syscalls, as with a kernel seqcount:
+ *	do {
+ *		seq = shm->seq;				(retry while odd, an update is in progress)
+ *		read barrier
+ *		copy the entries you need
+ *		read barrier
+ *	} while (seq & 1 || seq != shm->seq);
+ */
+#define MODEV_SHM_MAGIC		0x4d424853	/* "MBHS" */
+#define MODEV_SHM_VERSION	1
+#define MODEV_SHM_SIZE		4096
+
+/**
+ * struct modev_shm_entry - One value register of the device
+ * @slave:		Modbus slave address
+ * @reg:		Register address
+ * @value:		Last good value of the register
+ * @status:		Result of the latest sample, 0 or a negative errno
+ * @timestamp:	CLOCK_MONOTONIC time of @value in ns, 0 before the first good sample
+ */
+struct modev_shm_entry {
+	__u32	slave;
+	__u32	reg;
+	__u16	value;
+	__u16	reserved;
+	__s32	status;
+	__s64	timestamp;
+};
+
+/**
+ * struct modev_shm - Layout of the shared snapshot page
+ * @seq:			Sequence count, odd while the driver updates the page
+ * @magic:			MODEV_SHM_MAGIC
+ * @version:		MODEV_SHM_VERSION
+ * @num_entries:	Number of valid @entries, in the /dev read(..) order
+ * @generation:		Number of samples published so far, successful or not
+ * @entries:		One entry per value register
+ */
+struct modev_shm {
+	__u32					seq;
+	__u32					magic;
+	__u16					version;
+	__u16					num_entries;
+	__u32					generation;
+	struct modev_shm_entry	entries[];
+};
+
+/* -------------------------------------------------------------------------
+ * Sample history (ioctl)
+ * ------------------------------------------------------------------------- */
+#define MODEV_HIST_LEN		256		/* Samples kept per value register */
+
+/**
+ * struct modev_hist_entry - One sample of one value register
+ * @timestamp:	CLOCK_MONOTONIC time the sample was taken, in ns
+ * @value:		Register value, 0 when @status is an error
+ * @status:		0, or the negative errno of a failed sample
+ */
+struct modev_hist_entry {
+	__s64	timestamp;
+	__u16	value;
+	__u16	reserved;
+	__s32	status;
+};
+
+/**
+ * struct modev_hist_req - Argument of MODEV_IOC_HISTORY
+ * @reg_index:	Value register, index in the read(..) order
+ * @count:		In: room in @entries. Out: number of entries returned
+ * @since:		In: first sample number wanted, 0 for the oldest one kept.
+ *				Out: number of the next sample, pass it back to continue
+ * @entries:	User pointer to an array of struct modev_hist_entry
+ *
+ * Samples are numbered from 0 since probe and returned oldest first.
+ * When @since is older than the oldest sample kept, the history starts
+ * with the oldest one kept.
+ */
+struct modev_hist_req {
+	__u32	reg_index;
+	__u32	count;
+	__u64	since;
+	__u64	entries;
+};
+
+/* -------------------------------------------------------------------------
+ * Batched transactions (ioctl)
+ * ------------------------------------------------------------------------- */
+#define MODEV_BATCH_MAX		64		/* Operations per MODEV_IOC_BATCH call */
+#define MODEV_BATCH_MAX_READ	125	/* Registers / coils per read operation */
+#define MODEV_BATCH_MAX_WRITE	123	/* Registers / coils per FC15/FC16 operation, 121 for FC23 */
+
+/**
+ * struct modev_batch_op - One Modbus transaction of a batch
+ * @slave:		Slave address (1 - 247), any slave on the bus of the device
+ * @function:	Function code: 1 - 4 read, 5 write single coil, 6 write single register,
+ *				15 write multiple coils, 16 write multiple registers,
+ *				23 read/write multiple registers
+ * @start:		Address of the first register / coil, read or written
+ * @quantity:	Registers / coils to read (1 - MODEV_BATCH_MAX_READ) or to write
+ *				(1 - MODEV_BATCH_MAX_WRITE), or the value to write for 5 and 6
+ * @write_start:	Function 23 only, address of the first register to write, else 0
+ * @write_quantity:	Function 23 only, registers to write (1 - 121), else 0
+ * @count:		Out: number of values stored into @values
+ * @status:		Out: 0, or the negative errno of the transaction (see USERGUIDE section 6)
+ * @values:		User pointer to @quantity __u16, for reads (1 - 4 and 23) only
+ * @write_values:	User pointer to the __u16 values to write, @quantity of them for
+ *				15 and 16 (one per coil for 15, non-zero is ON), @write_quantity for 23
+ */
+struct modev_batch_op {
+	__u8	slave;
+	__u8	function;
+	__u16	start;
+	__u16	quantity;
+	__u16	write_start;
+	__u16	write_quantity;
+	__u16	count;
+	__s32	status;
+	__u64	values;
+	__u64	write_values;
+};
+
+/**
+ * struct modev_batch - Argument of MODEV_IOC_BATCH
+ * @num_ops:	Number of entries in @ops, 1 - MODEV_BATCH_MAX
+ * @reserved:	Must be 0
+ * @ops:		User pointer to an array of struct modev_batch_op, updated in place
+ *
+ * The operations are sent back to back in array order, nothing else is
+ * sent on the bus in between. A failed operation does not stop the others.
+ * The ioctl itself only fails for a malformed request, the file not being
+ * open for writing, or the bus being stopped.
+ */
+struct modev_batch {
+	__u32	num_ops;
+	__u32	reserved;
+	__u64	ops;
+};
+
+#define MODEV_IOC_MAGIC		'M'
+#define MODEV_IOC_HISTORY	_IOWR(MODEV_IOC_MAGIC, 1, struct modev_hist_req)
+#define MODEV_IOC_BATCH		_IOWR(MODEV_IOC_MAGIC, 2, struct modev_batch)
+
+#endif /* MODBUSDEVICE_UAPI_H */
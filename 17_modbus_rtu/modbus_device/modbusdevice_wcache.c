@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2026 Văn Tiến <tien11102004@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <linux/sort.h>
+#include "modbusdevice_sysfs.h"
+#include "modbus_controller.h"
+/* -------------------------------------------------------------------------
+ * Definition
+ * ------------------------------------------------------------------------- */
+#define WCACHE_DEFAULT_DELAY	50		/* ms, write-back delay after the first dirty register */
+
+/**
+ * struct wcache_entry - One dirty register taken by a flush
+ * @reg:	Register address
+ * @value:	Value to write
+ * @index:	Value register index, to mark it dirty again if the write fails
+ */
+struct wcache_entry {
+	uint16_t	reg;
+	uint16_t	value;
+	uint32_t	index;
+};
+
+/* -------------------------------------------------------------------------
+ Internal help function
+ * ------------------------------------------------------------------------- */
+static int cmp_entry(const void *a, const void *b)
+{
+	return (int)((const struct wcache_entry *)a)->reg - (int)((const struct wcache_entry *)b)->reg;
+}
+
+/* Delayed write-back, a failed flush keeps its registers dirty until the next write or commit */
+static void modev_wcache_work(struct work_struct *work)
+{
+	struct modev_private_data *dev_data = container_of(to_delayed_work(work),
+								struct modev_private_data, wc_work);
+	int ret_val = modev_wcache_flush(dev_data);
+
+	if (ret_val)
+		pr_err("Write-back to slave %u failed: %d\n", dev_data->pdata->slave_addr, ret_val);
+}
+
+/* Device going away, write back what is still dirty while the bus is there */
+static void modev_wcache_release(void *data)
+{
+	struct modev_private_data *dev_data = data;
+
+	cancel_delayed_work_sync(&dev_data->wc_work);
+	modev_wcache_flush(dev_data);
+}
+
+/* -------------------------------------------------------------------------
+ * Write cache
+ * ------------------------------------------------------------------------- */
+/*
+ * @brief Set up the write cache of a device, nothing is dirty.
+ * @params
+ *	-dev: Platform device, owner of the devm allocations
+ *	-dev_data: Private data with pdata and num_val already set
+ * @return 0 on success, negative errno otherwise
+ */
+int modev_wcache_init(struct device *dev, struct modev_private_data *dev_data)
+{
+	dev_data->wc_xfers = devm_kcalloc(dev, dev_data->num_val, sizeof(*dev_data->wc_xfers), GFP_KERNEL);
+	if (!dev_data->wc_xfers)
+		return -ENOMEM;
+	mutex_init(&dev_data->wc_lock);
+	mutex_init(&dev_data->wc_flush_lock);
+	INIT_DELAYED_WORK(&dev_data->wc_work, modev_wcache_work);
+	dev_data->wc_delay = WCACHE_DEFAULT_DELAY;
+	return devm_add_action_or_reset(dev, modev_wcache_release, dev_data);
+}
+
+/*
+ * @brief Store a value register into the write cache, the slave is written later.
+ * Every write of a burst lands in the cache, the flush sends the last value only.
+ * @params
+ *	-dev_data: Private data of the device
+ *	-index: Value register, in the 'lsmy,reg-addresses' order
+ *	-value: Value to write
+ * @return 0, or the flush result when the write-back delay is 0
+ */
+int modev_wcache_write(struct modev_private_data *dev_data, uint32_t index, uint16_t value)
+{
+	uint32_t delay;
+
+	if (index >= dev_data->num_val)
+		return -EINVAL;
+	/* FC16 writes holding registers, input registers are read-only */
+	if (dev_data->pdata->function != 3)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&dev_data->wc_lock);
+	for (int i = 0; i < dev_data->num_val; i++)
+	{
+		/* A register listed twice is cached under both indices */
+		if (dev_data->pdata->reg_address[i] != dev_data->pdata->reg_address[index])
+			continue;
+		dev_data->wc_values[i] = value;
+		__set_bit(i, dev_data->wc_dirty);
+	}
+	delay = dev_data->wc_delay;
+	mutex_unlock(&dev_data->wc_lock);
+
+	if (!delay)
+		return modev_wcache_flush(dev_data);
+	/* Already pending: the burst joins the write-back that is due */
+	schedule_delayed_work(&dev_data->wc_work, msecs_to_jiffies(delay));
+	return 0;
+}
+
+/*
+ * @brief Write every dirty register to the slave.
+ * Consecutive register addresses are merged into one FC16 request, all
+ * requests are queued on the bus at once, then collected in order.
+ * @params
+ *	-dev_data: Private data of the device
+ * @return 0 if nothing is left dirty by this flush, negative errno otherwise
+ */
+int modev_wcache_flush(struct modev_private_data *dev_data)
+{
+	struct wcache_entry entries[MAX_VAL];
+	struct modbus_xfer *xfer = NULL;
+	uint16_t regs[MAX_VAL];
+	uint32_t first[MAX_VAL];	/* First entry of every run */
+	uint32_t timeout = READ_ONCE(dev_data->timeout);
+	uint32_t num_entries = 0;
+	uint32_t num_runs = 0;
+	uint32_t num_regs = 0;
+	int submitted;
+	int ret_val = 0;
+	unsigned int i;
+
+	mutex_lock(&dev_data->wc_flush_lock);
+
+	/* 1. Take the dirty registers, a write from now on marks them dirty again */
+	mutex_lock(&dev_data->wc_lock);
+	for_each_set_bit(i, dev_data->wc_dirty, dev_data->num_val)
+	{
+		entries[num_entries].reg	= dev_data->pdata->reg_address[i];
+		entries[num_entries].value	= dev_data->wc_values[i];
+		entries[num_entries].index	= i;
+		num_entries++;
+	}
+	bitmap_zero(dev_data->wc_dirty, MAX_VAL);
+	mutex_unlock(&dev_data->wc_lock);
+	if (!num_entries)
+		goto out;
+
+	/* 2. Sort by address, one run per block of consecutive registers */
+	sort(entries, num_entries, sizeof(*entries), cmp_entry, NULL);
+	for (int j = 0; j < num_entries; j++)
+	{
+		if (j && entries[j].reg == entries[j - 1].reg)
+			continue;	/* Same register under two indices, same value */
+		if (!xfer || entries[j].reg != xfer->start + xfer->quantity ||
+				xfer->quantity == MODBUS_MAX_WRITE_REGS)
+		{
+			xfer = &dev_data->wc_xfers[num_runs];
+			first[num_runs++] = j;
+			xfer->address		= dev_data->pdata->slave_addr;
+			xfer->function		= 16;
+			xfer->start			= entries[j].reg;
+			xfer->quantity		= 0;
+			xfer->write_values	= &regs[num_regs];
+			xfer->timeout		= timeout;
+			xfer->values		= NULL;
+			xfer->complete		= NULL;
+		}
+		regs[num_regs++] = entries[j].value;
+		xfer->quantity++;
+	}
+
+	/* 3. Queue every run, the values are copied into the request PDU here */
+	for (submitted = 0; submitted < num_runs; submitted++)
+	{
+		ret_val = modbus_submit(dev_data->bus, &dev_data->wc_xfers[submitted]);
+		if (ret_val)
+			break;
+	}
+
+	/* 4. Collect the results, the registers of a failed run are dirty again */
+	for (int r = 0; r < num_runs; r++)
+	{
+		uint32_t last = (r + 1 < num_runs) ? first[r + 1] : num_entries;
+		int err = (r < submitted) ? modbus_send_errno(modbus_xfer_wait(&dev_data->wc_xfers[r])) : ret_val;
+
+		if (!err)
+			continue;
+		if (!ret_val)
+			ret_val = err;
+		mutex_lock(&dev_data->wc_lock);
+		for (int j = first[r]; j < last; j++)
+			__set_bit(entries[j].index, dev_data->wc_dirty);
+		mutex_unlock(&dev_data->wc_lock);
+	}
+	mb_dbg("Write-back: %u registers in %u requests, status %d\n", num_entries, num_runs, ret_val);
+
+	/* 5. Sample again, so readers see the written values without waiting a whole interval */
+	if (!ret_val)
+		modbus_poller_kick(dev_data->bus, &dev_data->poller);
+out:
+	mutex_unlock(&dev_data->wc_flush_lock);
+	return ret_val;
+}
+
+/* -------------------------------------------------------------------------
+ * Sysfs Callbacks
+ * ------------------------------------------------------------------------- */
+ssize_t commit_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
+	int ret_val = modev_wcache_flush(dev_data);
+
+	return ret_val ? ret_val : count;
+}
+
+ssize_t write_delay_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(dev_data->wc_delay));
+}
+
+ssize_t write_delay_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
+	uint32_t result;
+	int ret = kstrtou32(buf, 10, &result);
+	if (ret)
+		return ret;
+	mutex_lock(&dev_data->wc_lock);
+	dev_data->wc_delay = result;
+	mutex_unlock(&dev_data->wc_lock);
+	return count;
+}
+
+ssize_t reg_write_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct modev_private_data *dev_data = dev_get_drvdata(dev->parent);
+	uint32_t index;
+	uint32_t value;
+	int ret_val;
+
+	if (sscanf(buf, "%u %u", &index, &value) != 2)
+		return -EINVAL;
+	/* A wrapped setpoint must never reach the slave */
+	if (value > U16_MAX)
+		return -ERANGE;
+	ret_val = modev_wcache_write(dev_data, index, value);
+	return ret_val ? ret_val : count;
+}